@@ -2,21 +2,95 @@
 #include <bare.h>
 #include <js.h>
 #include <llama.h>
+#include <math.h>
 #include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#endif
+
+#if defined(__has_include)
+#if __has_include(<gguf.h>)
+#include <gguf.h> // Split out of ggml.h in newer llama.cpp
+#endif
+#endif
 
 typedef struct {
   struct llama_model *model;
   atomic_int refs;
+  double prefetch_time; // Milliseconds spent reading the file ahead of loading
+  bool mlock;
+  uint64_t memory_size; // Bytes accounted against the memory limit
+  char *path; // Kept to fingerprint the file for embedding cache files
+  uint64_t fingerprint; // Identifies the model file in embedding cache files
+  bool has_fingerprint; // Hashing reads the file, so it waits for a cache file
 } bare_llama_model_t;
 
+typedef struct bare_llama_session_s bare_llama_session_t;
+typedef struct bare_llama_embedding_cache_s bare_llama_embedding_cache_t;
+
+#define BARE_LLAMA_GRAMMAR_CACHE_SIZE 32
+
+// Query/document pairs a rank pooling context packs into one batch by default
+#define BARE_LLAMA_RERANK_SEQUENCES 8
+
+typedef struct {
+  uint64_t hash;
+  char *key;
+  uint64_t last_used;
+  struct llama_sampler *sampler; // Never sampled from, only cloned
+} bare_llama_grammar_entry_t;
+
 typedef struct {
   struct llama_context *ctx;
   atomic_int refs;
   struct llama_model *model;
+  bare_llama_model_t *owner; // Referenced so sessions can outlive LlamaModel.destroy
+  bare_llama_session_t **sessions; // Owner of each sequence id, NULL when free
+  bare_llama_session_t *sessions_head; // Every session, including evicted ones
+  uint64_t session_idle_timeout;
+  size_t session_memory_limit;
+  size_t evicted_size;
+  char *spill_dir;
+  uint64_t spill_count;
+  bare_llama_embedding_cache_t *embedding_cache;
+  bare_llama_grammar_entry_t grammars[BARE_LLAMA_GRAMMAR_CACHE_SIZE];
+  uint64_t grammar_clock;
   bool is_embedding;
+  bool flash_attn;
+  enum ggml_type type_k;
+  enum ggml_type type_v;
+  uint64_t kv_size;
+  double warmup_time; // Milliseconds spent in the warmup decode, 0 when skipped
+  uint64_t memory_size; // Bytes accounted against the memory limit
 } bare_llama_context_t;
 
+typedef struct {
+  char *role;
+  char *content;
+} bare_llama_message_t;
+
+struct bare_llama_session_s {
+  bare_llama_context_t *context;
+  llama_seq_id seq_id;
+  llama_pos n_past;
+  bare_llama_message_t *messages;
+  size_t n_messages;
+  size_t messages_size;
+  int32_t n_formatted; // Length of the formatted chat already in the KV cache
+  char *template;
+  uint64_t last_used;
+  uint8_t *state; // KV snapshot while evicted to memory
+  size_t state_size;
+  char *spill_path; // KV snapshot while evicted to disk
+  bare_llama_session_t *prev;
+  bare_llama_session_t *next;
+};
+
 typedef struct {
   bool add_special;
   bool parse_special;
@@ -74,497 +148,3020 @@ get_token_options (js_env_t *env, js_value_t *options, bare_llama_token_options_
   }
 }
 
-static void
-bare_llama_context_teardown (void *data) {
-  bare_llama_context_t *ctx = (bare_llama_context_t *) data;
+static bool
+is_nullish (js_env_t *env, js_value_t *value) {
+  int err;
 
-  if (--ctx->refs == 0) {
-    llama_free(ctx->ctx);
-    free(ctx);
-  }
+  bool is_null;
+  err = js_is_null(env, value, &is_null);
+  assert(err == 0);
+
+  bool is_undefined;
+  err = js_is_undefined(env, value, &is_undefined);
+  assert(err == 0);
+
+  return is_null || is_undefined;
 }
 
-static void
-bare_llama_context_finalize (js_env_t *env, void *data, void *finalize_hint) {
+static bool
+get_bool_option (js_env_t *env, js_value_t *options, const char *name, bool *result) {
   int err;
 
-  bare_llama_context_teardown(data);
+  js_value_t *val;
+  if (js_get_named_property(env, options, name, &val) != 0 || is_nullish(env, val)) return false;
 
-  err = js_remove_teardown_callback(env, bare_llama_context_teardown, data);
+  err = js_get_value_bool(env, val, result);
   assert(err == 0);
+
+  return true;
 }
 
-static js_value_t *
-bare_llama_context_destroy (js_env_t *env, js_callback_info_t *info) {
+static bool
+get_uint32_option (js_env_t *env, js_value_t *options, const char *name, uint32_t *result) {
   int err;
 
-  size_t argc = 1; // context instance
-  js_value_t *argv[1];
+  js_value_t *val;
+  if (js_get_named_property(env, options, name, &val) != 0 || is_nullish(env, val)) return false;
 
-  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  err = js_get_value_uint32(env, val, result);
   assert(err == 0);
-  assert(argc == 1);
 
-  bare_llama_context_t *context;
-  err = js_remove_wrap(env, argv[0], (void **) &context);
-  assert(err == 0);
+  return true;
+}
 
-  err = js_remove_teardown_callback(env, bare_llama_context_teardown, (void *) context);
+static bool
+get_int32_option (js_env_t *env, js_value_t *options, const char *name, int32_t *result) {
+  int err;
+
+  js_value_t *val;
+  if (js_get_named_property(env, options, name, &val) != 0 || is_nullish(env, val)) return false;
+
+  err = js_get_value_int32(env, val, result);
   assert(err == 0);
 
-  bare_llama_context_teardown((void *) context);
+  return true;
+}
 
-  return NULL;
+static bool
+get_int64_option (js_env_t *env, js_value_t *options, const char *name, int64_t *result) {
+  int err;
+
+  js_value_t *val;
+  if (js_get_named_property(env, options, name, &val) != 0 || is_nullish(env, val)) return false;
+
+  err = js_get_value_int64(env, val, result);
+  assert(err == 0);
+
+  return true;
 }
 
-static js_value_t *
-bare_llama_context_create (js_env_t *env, js_callback_info_t *info) {
+static bool
+get_double_option (js_env_t *env, js_value_t *options, const char *name, double *result) {
   int err;
 
-  size_t argc = 3; // instance, model instance, and options object
-  js_value_t *argv[3];
+  js_value_t *val;
+  if (js_get_named_property(env, options, name, &val) != 0 || is_nullish(env, val)) return false;
 
-  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  err = js_get_value_double(env, val, result);
   assert(err == 0);
 
-  bare_llama_model_t *model;
-  err = js_unwrap(env, argv[1], (void **) &model);
+  return true;
+}
+
+static char *
+get_string_value (js_env_t *env, js_value_t *value) {
+  int err;
+
+  size_t len;
+  err = js_get_value_string_utf8(env, value, NULL, 0, &len);
   assert(err == 0);
 
-  // Set up default context params
-  struct llama_context_params params = llama_context_default_params();
-  params.n_ctx = 2048;
-  params.n_batch = 512;
+  utf8_t *str = malloc(len + 1);
+  err = js_get_value_string_utf8(env, value, str, len + 1, NULL);
+  assert(err == 0);
 
-  // Parse options
-  bool is_embedding = false;
-  if (argc > 2) {
-    bool is_null;
-    err = js_is_null(env, argv[2], &is_null);
-    assert(err == 0);
+  return (char *) str;
+}
 
-    bool is_undefined;
-    err = js_is_undefined(env, argv[2], &is_undefined);
-    assert(err == 0);
+static bool
+get_string_option (js_env_t *env, js_value_t *options, const char *name, char *result, size_t len) {
+  int err;
 
-    // TODO: helper function that checks for null/undefined?
+  js_value_t *val;
+  if (js_get_named_property(env, options, name, &val) != 0 || is_nullish(env, val)) return false;
 
-    if (!is_null && !is_undefined) {
-        js_value_t *embedding_val;
-        if (js_get_named_property(env, argv[2], "embedding", &embedding_val) == 0) {
-            err = js_get_value_bool(env, embedding_val, &is_embedding);
-            assert(err == 0);
-        }
-    }
+  size_t written;
+  err = js_get_value_string_utf8(env, val, (utf8_t *) result, len - 1, &written);
+  assert(err == 0);
 
-    js_value_t *context_size_val;
-    if (js_get_named_property(env, argv[2], "contextSize", &context_size_val) == 0) {
-      err = js_get_value_uint32(env, context_size_val, &params.n_ctx);
-      assert(err == 0);
-    } else {
-      params.n_ctx = 2048; // default value
-    }
+  result[written] = '\0';
 
-    js_value_t *batch_size_val;
-    if (js_get_named_property(env, argv[2], "batchSize", &batch_size_val) == 0) {
-      err = js_get_value_uint32(env, batch_size_val, &params.n_batch);
-      assert(err == 0);
-    } else {
-      params.n_batch = 512; // default value
+  return true;
+}
+
+typedef struct {
+  const char *name;
+  enum ggml_type type;
+} bare_llama_cache_type_t;
+
+static const bare_llama_cache_type_t bare_llama_cache_types[] = {
+  {"f32", GGML_TYPE_F32},
+  {"f16", GGML_TYPE_F16},
+  {"bf16", GGML_TYPE_BF16},
+  {"q8_0", GGML_TYPE_Q8_0},
+  {"q5_1", GGML_TYPE_Q5_1},
+  {"q5_0", GGML_TYPE_Q5_0},
+  {"q4_1", GGML_TYPE_Q4_1},
+  {"q4_0", GGML_TYPE_Q4_0},
+};
+
+static bool
+get_cache_type (const char *name, enum ggml_type *result) {
+  size_t len = sizeof(bare_llama_cache_types) / sizeof(bare_llama_cache_types[0]);
+
+  for (size_t i = 0; i < len; i++) {
+    if (strcmp(bare_llama_cache_types[i].name, name) == 0) {
+      *result = bare_llama_cache_types[i].type;
+      return true;
     }
   }
 
-  // Set mode-specific params
-  if (is_embedding) {
-    params.embeddings = true;
-    params.logits_all = false;
-  } else {
-    params.embeddings = false;
-    params.logits_all = false;
+  return false;
+}
+
+static const char *
+get_cache_type_name (enum ggml_type type) {
+  size_t len = sizeof(bare_llama_cache_types) / sizeof(bare_llama_cache_types[0]);
+
+  for (size_t i = 0; i < len; i++) {
+    if (bare_llama_cache_types[i].type == type) return bare_llama_cache_types[i].name;
   }
 
-  struct llama_context *llama_ctx = llama_new_context_with_model(model->model, params);
+  return ggml_type_name(type);
+}
 
-  if (llama_ctx == NULL) {
-    err = js_throw_error(env, NULL, "Failed to create context");
-    assert(err == 0);
-    return NULL;
+typedef struct {
+  const char *name;
+  enum llama_pooling_type type;
+} bare_llama_pooling_type_t;
+
+static const bare_llama_pooling_type_t bare_llama_pooling_types[] = {
+  {"none", LLAMA_POOLING_TYPE_NONE},
+  {"mean", LLAMA_POOLING_TYPE_MEAN},
+  {"cls", LLAMA_POOLING_TYPE_CLS},
+  {"last", LLAMA_POOLING_TYPE_LAST},
+  {"rank", LLAMA_POOLING_TYPE_RANK},
+};
+
+static bool
+get_pooling_type (const char *name, enum llama_pooling_type *result) {
+  size_t len = sizeof(bare_llama_pooling_types) / sizeof(bare_llama_pooling_types[0]);
+
+  for (size_t i = 0; i < len; i++) {
+    if (strcmp(bare_llama_pooling_types[i].name, name) == 0) {
+      *result = bare_llama_pooling_types[i].type;
+      return true;
+    }
   }
 
-  bare_llama_context_t *ctx = malloc(sizeof(bare_llama_context_t));
-  ctx->ctx = llama_ctx;
-  ctx->refs = 1;
-  ctx->model = model->model;
-  ctx->is_embedding = is_embedding;
+  return false;
+}
 
-  err = js_wrap(env, argv[0], ctx, bare_llama_context_finalize, NULL, NULL);
-  assert(err == 0);
+static const char *
+get_pooling_type_name (enum llama_pooling_type type) {
+  size_t len = sizeof(bare_llama_pooling_types) / sizeof(bare_llama_pooling_types[0]);
 
-  err = js_add_teardown_callback(env, bare_llama_context_teardown, (void *) ctx);
-  assert(err == 0);
+  for (size_t i = 0; i < len; i++) {
+    if (bare_llama_pooling_types[i].type == type) return bare_llama_pooling_types[i].name;
+  }
 
-  return NULL;
+  return "unspecified";
 }
 
-static js_value_t *
-bare_llama_context_encode (js_env_t *env, js_callback_info_t *info) {
-  int err;
+static int32_t
+get_model_meta_int (struct llama_model *model, const char *suffix, int32_t fallback) {
+  char arch[64];
+  if (llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch)) < 0) return fallback;
 
-  size_t argc = 3;
-  js_value_t *argv[3];
+  char key[128];
+  snprintf(key, sizeof(key), "%s.%s", arch, suffix);
 
-  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
-  assert(err == 0);
+  char val[32];
+  if (llama_model_meta_val_str(model, key, val, sizeof(val)) < 0) return fallback;
 
-  bare_llama_context_t *ctx;
-  err = js_unwrap(env, argv[0], (void **) &ctx);
-  assert(err == 0);
+  return (int32_t) strtol(val, NULL, 10);
+}
 
-  if (!ctx->is_embedding) {
-    err = js_throw_error(env, NULL, "Context not configured for embeddings");
-    assert(err == 0);
-    return NULL;
-  }
+// Estimated size in bytes of the K and V buffers llama.cpp allocates for a
+// context of n_ctx cells, from the model's attention shape. Grouped-query
+// attention models only cache n_head_kv heads. llama.cpp does not expose the
+// real buffer size, and this does not model sliding window or recurrent
+// caches, which allocate differently.
+static uint64_t
+get_kv_cache_size (struct llama_model *model, uint32_t n_ctx, enum ggml_type type_k, enum ggml_type type_v) {
+  int32_t n_layer = llama_n_layer(model);
+  int32_t n_embd = llama_n_embd(model);
+  int32_t n_head = llama_n_head(model);
+  int32_t n_head_kv = get_model_meta_int(model, "attention.head_count_kv", n_head);
+
+  int32_t n_embd_head_k = get_model_meta_int(model, "attention.key_length", n_embd / n_head);
+  int32_t n_embd_head_v = get_model_meta_int(model, "attention.value_length", n_embd / n_head);
+
+  uint64_t k = ggml_row_size(type_k, (int64_t) n_embd_head_k * n_head_kv);
+  uint64_t v = ggml_row_size(type_v, (int64_t) n_embd_head_v * n_head_kv);
+
+  return (uint64_t) n_layer * n_ctx * (k + v);
+}
 
-  bare_llama_token_options_t token_opts;
-  get_token_options(env, argc > 2 ? argv[2] : NULL, &token_opts);
+// Process-wide accounting of the memory held by models, contexts and evicted
+// session snapshots, checked against an optional budget before anything
+// large is allocated
+static struct {
+  atomic_uint_fast64_t limit; // 0 when unlimited
+  atomic_uint_fast64_t used;
+  atomic_uint_fast64_t models;
+  atomic_uint_fast64_t contexts;
+  atomic_uint_fast64_t sessions;
+} bare_llama_memory;
+
+static bool
+memory_reserve (atomic_uint_fast64_t *category, uint64_t size) {
+  uint_fast64_t used = atomic_load(&bare_llama_memory.used);
+
+  do {
+    uint64_t limit = atomic_load(&bare_llama_memory.limit);
+    if (limit > 0 && used + size > limit) return false;
+  } while (!atomic_compare_exchange_weak(&bare_llama_memory.used, &used, used + size));
+
+  atomic_fetch_add(category, size);
+
+  return true;
+}
 
-  // First tokenize the input
-  size_t text_len;
-  err = js_get_value_string_utf8(env, argv[1], NULL, 0, &text_len);
-  assert(err == 0);
+// Record memory that is already allocated, or released, and so cannot be refused
+static void
+memory_track (atomic_uint_fast64_t *category, int64_t delta) {
+  if (delta >= 0) {
+    atomic_fetch_add(&bare_llama_memory.used, (uint64_t) delta);
+    atomic_fetch_add(category, (uint64_t) delta);
+  } else {
+    atomic_fetch_sub(&bare_llama_memory.used, (uint64_t) -delta);
+    atomic_fetch_sub(category, (uint64_t) -delta);
+  }
+}
 
-  utf8_t *text = malloc(text_len + 1);
-  err = js_get_value_string_utf8(env, argv[1], text, text_len + 1, NULL);
-  assert(err == 0);
+// Estimate of everything a context allocates: the KV cache, the output
+// buffer sized for the worst case of logits for every token in a batch, and
+// the largest intermediate tensors of the compute graph for one ubatch
+static uint64_t
+get_context_memory_size (struct llama_model *model, struct llama_context_params *params, uint32_t n_ctx) {
+  uint64_t n_vocab = llama_n_vocab(model);
+  uint64_t n_embd = llama_n_embd(model);
+  uint64_t n_head = llama_n_head(model);
+  uint64_t n_ubatch = params->n_ubatch < params->n_batch ? params->n_ubatch : params->n_batch;
+
+  uint64_t kv = get_kv_cache_size(model, n_ctx, params->type_k, params->type_v);
+  uint64_t output = sizeof(float) * params->n_batch * (params->embeddings ? n_embd : n_vocab);
+  uint64_t compute = sizeof(float) * n_ubatch * (n_vocab + 4 * n_embd + (params->flash_attn ? 0 : n_ctx * n_head));
+
+  return kv + output + compute;
+}
 
-  // Get tokens
-  int n_tokens = llama_tokenize(ctx->model, (const char *) text, text_len, NULL, 0, token_opts.add_special, token_opts.parse_special);
-  if (n_tokens < 0) {
-    n_tokens = -n_tokens;
+typedef struct bare_llama_embedding_entry_s bare_llama_embedding_entry_t;
+
+struct bare_llama_embedding_entry_s {
+  uint64_t hash;
+  uint32_t flags;
+  int32_t n_tokens;
+  llama_token *tokens;
+  float *embd;
+  bare_llama_embedding_entry_t *next_in_bucket;
+  bare_llama_embedding_entry_t *prev; // More recently used
+  bare_llama_embedding_entry_t *next; // Less recently used
+};
+
+// Size-bounded LRU of pooled embeddings, keyed by the token sequence and the
+// pooling and normalization that produced them.
+struct bare_llama_embedding_cache_s {
+  bare_llama_embedding_entry_t **buckets;
+  size_t n_buckets;
+  size_t n_entries;
+  bare_llama_embedding_entry_t *head;
+  bare_llama_embedding_entry_t *tail;
+  size_t size;
+  size_t max_size;
+  uint64_t hits;
+  uint64_t misses;
+  int32_t n_embd;
+};
+
+#define BARE_LLAMA_EMBEDDING_CACHE_MAGIC   0x43454c42 // "BLEC"
+#define BARE_LLAMA_EMBEDDING_CACHE_VERSION 1
+
+// FNV-1a over the raw bytes
+static uint64_t
+hash_bytes (uint64_t hash, const void *data, size_t len) {
+  const uint8_t *bytes = (const uint8_t *) data;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
   }
 
-  llama_token *tokens = malloc(n_tokens * sizeof(llama_token));
-  int result_tokens = llama_tokenize(ctx->model, (const char *) text, text_len, tokens, n_tokens, token_opts.add_special, token_opts.parse_special);
+  return hash;
+}
 
-  // Prepare batch
-  struct llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+static uint64_t
+hash_tokens (const llama_token *tokens, int32_t n_tokens, uint32_t flags) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  hash = hash_bytes(hash, &flags, sizeof(flags));
+  return hash_bytes(hash, tokens, n_tokens * sizeof(llama_token));
+}
 
-  batch.n_tokens = result_tokens;
+static size_t
+get_embedding_entry_size (bare_llama_embedding_cache_t *cache, int32_t n_tokens) {
+  return sizeof(bare_llama_embedding_entry_t) + n_tokens * sizeof(llama_token) + cache->n_embd * sizeof(float);
+}
 
-  for (int i = 0; i < n_tokens; i++) {
-    batch.token[i] = tokens[i];
-    batch.pos[i] = i;
-    batch.n_seq_id[i] = 1;
-    batch.seq_id[i][0] = 0;
-    batch.logits[i] = false;
-  }
-  // Ask for embeddings for the last token
-  batch.logits[n_tokens - 1] = true;
+static bare_llama_embedding_cache_t *
+embedding_cache_init (size_t max_size, int32_t n_embd) {
+  bare_llama_embedding_cache_t *cache = calloc(1, sizeof(bare_llama_embedding_cache_t));
+  cache->n_buckets = 256;
+  cache->buckets = calloc(cache->n_buckets, sizeof(bare_llama_embedding_entry_t *));
+  cache->max_size = max_size;
+  cache->n_embd = n_embd;
+  return cache;
+}
 
-  // Decode batch
-  int ret = llama_decode(ctx->ctx, batch);
+static void
+embedding_cache_unlink (bare_llama_embedding_cache_t *cache, bare_llama_embedding_entry_t *entry) {
+  if (entry->prev) entry->prev->next = entry->next;
+  else cache->head = entry->next;
 
-  if (ret != 0) {
-    free(tokens);
-    free(text);
-    llama_batch_free(batch);
-    err = js_throw_error(env, NULL, "Failed to process text");
-    assert(err == 0);
-    return NULL;
-  }
+  if (entry->next) entry->next->prev = entry->prev;
+  else cache->tail = entry->prev;
 
-  // Make sure processing is complete
-  llama_synchronize(ctx->ctx);
+  entry->prev = entry->next = NULL;
+}
 
-  enum llama_pooling_type pooling_type = llama_pooling_type(ctx->ctx);
+static void
+embedding_cache_push_front (bare_llama_embedding_cache_t *cache, bare_llama_embedding_entry_t *entry) {
+  entry->prev = NULL;
+  entry->next = cache->head;
 
-  const float *embeddings = NULL;
+  if (cache->head) cache->head->prev = entry;
+  else cache->tail = entry;
 
-  if (pooling_type != LLAMA_POOLING_TYPE_NONE) {
-    embeddings = llama_get_embeddings_seq(ctx->ctx, 0);
-  }
+  cache->head = entry;
+}
 
-  if (embeddings == NULL) {
-    embeddings = llama_get_embeddings(ctx->ctx);
-  }
+static void
+embedding_cache_remove (bare_llama_embedding_cache_t *cache, bare_llama_embedding_entry_t *entry) {
+  bare_llama_embedding_entry_t **slot = &cache->buckets[entry->hash % cache->n_buckets];
+  while (*slot != entry) slot = &(*slot)->next_in_bucket;
+  *slot = entry->next_in_bucket;
 
-  int n_embd = llama_n_embd(ctx->model);
+  embedding_cache_unlink(cache, entry);
 
-  if (embeddings == NULL) {
-    free(tokens);
-    free(text);
-    llama_batch_free(batch);
-    err = js_throw_error(env, NULL, "Failed to get embeddings");
-    assert(err == 0);
-    return NULL;
+  cache->size -= get_embedding_entry_size(cache, entry->n_tokens);
+  cache->n_entries--;
+
+  free(entry->tokens);
+  free(entry->embd);
+  free(entry);
+}
+
+static void
+embedding_cache_free (bare_llama_embedding_cache_t *cache) {
+  while (cache->head) embedding_cache_remove(cache, cache->head);
+
+  free(cache->buckets);
+  free(cache);
+}
+
+static bare_llama_embedding_entry_t *
+embedding_cache_find (bare_llama_embedding_cache_t *cache, uint64_t hash, const llama_token *tokens, int32_t n_tokens, uint32_t flags) {
+  bare_llama_embedding_entry_t *entry = cache->buckets[hash % cache->n_buckets];
+
+  for (; entry != NULL; entry = entry->next_in_bucket) {
+    if (entry->hash != hash || entry->flags != flags || entry->n_tokens != n_tokens) continue;
+    if (memcmp(entry->tokens, tokens, n_tokens * sizeof(llama_token)) == 0) return entry;
   }
 
-  // Create result Float64Array
-  js_value_t *result;
-  err = js_create_arraybuffer(env, n_embd * sizeof(double), NULL, &result);
-  assert(err == 0);
+  return NULL;
+}
 
-  double *data;
-  size_t length;
-  err = js_get_arraybuffer_info(env, result, (void **) &data, &length);
-  assert(err == 0);
+static bare_llama_embedding_entry_t *
+embedding_cache_get (bare_llama_embedding_cache_t *cache, uint64_t hash, const llama_token *tokens, int32_t n_tokens, uint32_t flags) {
+  bare_llama_embedding_entry_t *entry = embedding_cache_find(cache, hash, tokens, n_tokens, flags);
 
-  // Copy embeddings to result
-  for (int i = 0; i < n_embd; i++) {
-    data[i] = (double) embeddings[i];
+  if (entry == NULL) {
+    cache->misses++;
+    return NULL;
   }
 
-  free(tokens);
-  free(text);
-  llama_batch_free(batch);
+  embedding_cache_unlink(cache, entry);
+  embedding_cache_push_front(cache, entry);
 
-  return result;
+  cache->hits++;
+
+  return entry;
 }
 
-static int
-resample_until_valid (
-    struct llama_sampler *chain,
-    struct llama_context *ctx,
-    struct llama_model *model,
-    llama_token *token_out,
-    char *text_out,
-    size_t text_max_len,
-    int max_attempts
-) {
-  for (int attempt = 0; attempt < max_attempts; attempt++) {
-    llama_token new_token = llama_sampler_sample(chain, ctx, 0);
+static void
+embedding_cache_put (bare_llama_embedding_cache_t *cache, uint64_t hash, const llama_token *tokens, int32_t n_tokens, uint32_t flags, const float *embd) {
+  size_t size = get_embedding_entry_size(cache, n_tokens);
+  if (size > cache->max_size) return;
 
-    // Check for EOS
-    if (llama_token_eos(model) == new_token) {
-      return -1;
-    }
+  while (cache->size + size > cache->max_size) {
+    embedding_cache_remove(cache, cache->tail);
+  }
 
-    // Try to get text
-    int token_len = llama_token_to_piece(model, new_token, text_out, text_max_len, 0, true);
+  if (cache->n_entries >= cache->n_buckets) {
+    size_t n_buckets = cache->n_buckets * 2;
+    bare_llama_embedding_entry_t **buckets = calloc(n_buckets, sizeof(bare_llama_embedding_entry_t *));
 
-    if (token_len > 0) {
-      *token_out = new_token;
-      return token_len;
+    for (bare_llama_embedding_entry_t *entry = cache->head; entry != NULL; entry = entry->next) {
+      bare_llama_embedding_entry_t **slot = &buckets[entry->hash % n_buckets];
+      entry->next_in_bucket = *slot;
+      *slot = entry;
     }
+
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->n_buckets = n_buckets;
   }
 
-  return -1;
+  bare_llama_embedding_entry_t *entry = malloc(sizeof(bare_llama_embedding_entry_t));
+  entry->hash = hash;
+  entry->flags = flags;
+  entry->n_tokens = n_tokens;
+  entry->tokens = malloc((n_tokens > 0 ? n_tokens : 1) * sizeof(llama_token));
+  memcpy(entry->tokens, tokens, n_tokens * sizeof(llama_token));
+  entry->embd = malloc(cache->n_embd * sizeof(float));
+  memcpy(entry->embd, embd, cache->n_embd * sizeof(float));
+
+  bare_llama_embedding_entry_t **slot = &cache->buckets[hash % cache->n_buckets];
+  entry->next_in_bucket = *slot;
+  *slot = entry;
+
+  embedding_cache_push_front(cache, entry);
+
+  cache->size += size;
+  cache->n_entries++;
 }
 
-static js_value_t *
-bare_llama_context_generate (js_env_t *env, js_callback_info_t *info) {
-    int err;
+// Identify the model so a persisted cache is never applied to another one
+#define BARE_LLAMA_FINGERPRINT_SAMPLE (1024 * 1024)
 
-    size_t argc = 4; // context instance, text, and options
-    js_value_t *argv[4];
+static uint64_t
+hash_file_range (uv_loop_t *loop, uv_file fd, uint64_t hash, int64_t offset, size_t len, char *buf) {
+  uv_fs_t req;
+  uv_buf_t chunk = uv_buf_init(buf, (unsigned int) len);
 
-    err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
-    assert(err == 0);
+  int n = uv_fs_read(loop, &req, fd, &chunk, 1, offset, NULL);
+  uv_fs_req_cleanup(&req);
 
-    bare_llama_context_t *ctx;
-    err = js_unwrap(env, argv[0], (void **) &ctx);
-    assert(err == 0);
+  return n > 0 ? hash_bytes(hash, buf, n) : hash;
+}
 
-    if (ctx->is_embedding) {
-    err = js_throw_error(env, NULL, "Context not configured for generation");
-    assert(err == 0);
-    return NULL;
-    }
+// Identify a model file by its size, its leading bytes, which hold the GGUF
+// metadata and tensor infos, and its trailing bytes, which hold weights.
+// Fine-tunes of the same base share the header but not the weights.
+static uint64_t
+hash_model_file (uv_loop_t *loop, const char *path) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
 
-    bare_llama_token_options_t token_opts;
-    get_token_options(env, argc > 3 ? argv[3] : NULL, &token_opts);
+  uv_fs_t req;
+  uv_file fd = uv_fs_open(loop, &req, path, UV_FS_O_RDONLY, 0, NULL);
+  uv_fs_req_cleanup(&req);
 
-    // Parse generation options
-    int max_tokens = 20;
-    float temperature = 0.8f;
-    int top_k = 40;
+  if (fd < 0) return hash;
 
-    if (argc > 2) {
-    bool is_null;
-    err = js_is_null(env, argv[2], &is_null);
-    assert(err == 0);
+  uint64_t size = uv_fs_fstat(loop, &req, fd, NULL) == 0 ? req.statbuf.st_size : 0;
+  uv_fs_req_cleanup(&req);
 
-    bool is_undefined;
-    err = js_is_undefined(env, argv[2], &is_undefined);
-    assert(err == 0);
+  hash = hash_bytes(hash, &size, sizeof(size));
 
-    if (!is_null && !is_undefined) {
-        js_value_t *max_tokens_val;
-        if (js_get_named_property(env, argv[2], "maxTokens", &max_tokens_val) == 0) {
-        err = js_get_value_int32(env, max_tokens_val, &max_tokens);
-        assert(err == 0);
-        }
+  char *buf = malloc(BARE_LLAMA_FINGERPRINT_SAMPLE);
 
-        js_value_t *temp_val;
-        if (js_get_named_property(env, argv[2], "temperature", &temp_val) == 0) {
-        double temp;
-        err = js_get_value_double(env, temp_val, &temp);
-        assert(err == 0);
-        temperature = (float) temp;
-        }
+  hash = hash_file_range(loop, fd, hash, 0, BARE_LLAMA_FINGERPRINT_SAMPLE, buf);
 
-        js_value_t *top_k_val;
-        if (js_get_named_property(env, argv[2], "topK", &top_k_val) == 0) {
-        err = js_get_value_int32(env, top_k_val, &top_k);
-        assert(err == 0);
-        }
+  if (size > 2 * BARE_LLAMA_FINGERPRINT_SAMPLE) {
+    hash = hash_file_range(loop, fd, hash, (int64_t) (size - BARE_LLAMA_FINGERPRINT_SAMPLE), BARE_LLAMA_FINGERPRINT_SAMPLE, buf);
+  }
+
+  free(buf);
+
+  uv_fs_close(loop, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+
+  return hash;
+}
+
+static uint64_t
+get_model_fingerprint (uv_loop_t *loop, bare_llama_model_t *model) {
+  if (!model->has_fingerprint) {
+    model->fingerprint = hash_model_file(loop, model->path);
+    model->has_fingerprint = true;
+  }
+
+  return model->fingerprint;
+}
+
+// Write entries least recently used first, so loading them in order restores
+// the same recency.
+static bool
+embedding_cache_save (bare_llama_embedding_cache_t *cache, uint64_t model_hash, const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) return false;
+
+  uint32_t header[2] = {BARE_LLAMA_EMBEDDING_CACHE_MAGIC, BARE_LLAMA_EMBEDDING_CACHE_VERSION};
+  uint64_t n_entries = cache->n_entries;
+
+  bool ok = fwrite(header, sizeof(header), 1, file) == 1 &&
+            fwrite(&model_hash, sizeof(model_hash), 1, file) == 1 &&
+            fwrite(&cache->n_embd, sizeof(cache->n_embd), 1, file) == 1 &&
+            fwrite(&n_entries, sizeof(n_entries), 1, file) == 1;
+
+  for (bare_llama_embedding_entry_t *entry = cache->tail; ok && entry != NULL; entry = entry->prev) {
+    ok = fwrite(&entry->hash, sizeof(entry->hash), 1, file) == 1 &&
+         fwrite(&entry->flags, sizeof(entry->flags), 1, file) == 1 &&
+         fwrite(&entry->n_tokens, sizeof(entry->n_tokens), 1, file) == 1 &&
+         fwrite(entry->tokens, sizeof(llama_token), entry->n_tokens, file) == (size_t) entry->n_tokens &&
+         fwrite(entry->embd, sizeof(float), cache->n_embd, file) == (size_t) cache->n_embd;
+  }
+
+  return fclose(file) == 0 && ok;
+}
+
+static bool
+embedding_cache_load (bare_llama_embedding_cache_t *cache, uint64_t model_hash, const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) return false;
+
+  uint32_t header[2];
+  uint64_t file_model_hash;
+  int32_t n_embd;
+  uint64_t n_entries;
+
+  bool ok = fread(header, sizeof(header), 1, file) == 1 &&
+            fread(&file_model_hash, sizeof(file_model_hash), 1, file) == 1 &&
+            fread(&n_embd, sizeof(n_embd), 1, file) == 1 &&
+            fread(&n_entries, sizeof(n_entries), 1, file) == 1 &&
+            header[0] == BARE_LLAMA_EMBEDDING_CACHE_MAGIC &&
+            header[1] == BARE_LLAMA_EMBEDDING_CACHE_VERSION &&
+            file_model_hash == model_hash &&
+            n_embd == cache->n_embd;
+
+  float *embd = malloc(cache->n_embd * sizeof(float));
+
+  for (uint64_t i = 0; ok && i < n_entries; i++) {
+    uint64_t hash;
+    uint32_t flags;
+    int32_t n_tokens;
+
+    ok = fread(&hash, sizeof(hash), 1, file) == 1 &&
+         fread(&flags, sizeof(flags), 1, file) == 1 &&
+         fread(&n_tokens, sizeof(n_tokens), 1, file) == 1 &&
+         n_tokens >= 0;
+
+    if (!ok) break;
+
+    llama_token *tokens = malloc((n_tokens > 0 ? n_tokens : 1) * sizeof(llama_token));
+
+    ok = fread(tokens, sizeof(llama_token), n_tokens, file) == (size_t) n_tokens &&
+         fread(embd, sizeof(float), cache->n_embd, file) == (size_t) cache->n_embd;
+
+    if (ok && embedding_cache_find(cache, hash, tokens, n_tokens, flags) == NULL) {
+      embedding_cache_put(cache, hash, tokens, n_tokens, flags, embd);
     }
+
+    free(tokens);
+  }
+
+  free(embd);
+  fclose(file);
+
+  return ok;
+}
+
+static void
+bare_llama_model_teardown (void *data);
+
+static void
+bare_llama_context_teardown (void *data) {
+  bare_llama_context_t *ctx = (bare_llama_context_t *) data;
+
+  if (--ctx->refs == 0) {
+    llama_free(ctx->ctx);
+    bare_llama_model_teardown(ctx->owner);
+    memory_track(&bare_llama_memory.contexts, -(int64_t) ctx->memory_size);
+    if (ctx->embedding_cache) embedding_cache_free(ctx->embedding_cache);
+    for (int i = 0; i < BARE_LLAMA_GRAMMAR_CACHE_SIZE; i++) {
+      if (ctx->grammars[i].sampler) llama_sampler_free(ctx->grammars[i].sampler);
+      free(ctx->grammars[i].key);
     }
+    free(ctx->sessions);
+    free(ctx->spill_dir);
+    free(ctx);
+  }
+}
 
-    // Get input text
-    size_t text_len;
-    err = js_get_value_string_utf8(env, argv[1], NULL, 0, &text_len);
-    assert(err == 0);
+static void
+bare_llama_context_finalize (js_env_t *env, void *data, void *finalize_hint) {
+  int err;
 
-    utf8_t *text = malloc(text_len + 1);
-    err = js_get_value_string_utf8(env, argv[1], text, text_len + 1, NULL);
-    assert(err == 0);
+  bare_llama_context_teardown(data);
+
+  err = js_remove_teardown_callback(env, bare_llama_context_teardown, data);
+  assert(err == 0);
+}
+
+static js_value_t *
+bare_llama_context_destroy (js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 1; // context instance
+  js_value_t *argv[1];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc == 1);
+
+  bare_llama_context_t *context;
+  err = js_remove_wrap(env, argv[0], (void **) &context);
+  assert(err == 0);
+
+  err = js_remove_teardown_callback(env, bare_llama_context_teardown, (void *) context);
+  assert(err == 0);
 
-    // Tokenize input
-    int n_tokens = llama_tokenize(ctx->model, (const char *) text, text_len, NULL, 0, token_opts.add_special, token_opts.parse_special);
-    if (n_tokens < 0) n_tokens = -n_tokens;
+  bare_llama_context_teardown((void *) context);
 
-    llama_token *tokens = malloc(n_tokens * sizeof(llama_token));
-    int result_tokens = llama_tokenize(ctx->model, (const char *) text, text_len, tokens, n_tokens, token_opts.add_special, token_opts.parse_special);
+  return NULL;
+}
 
-    // Initialize sampling chain
-    struct llama_sampler_chain_params chain_params = llama_sampler_chain_default_params();
-    struct llama_sampler *chain = llama_sampler_chain_init(chain_params);
-    llama_sampler_chain_add(chain, llama_sampler_init_top_k(top_k));
-    llama_sampler_chain_add(chain, llama_sampler_init_temp(temperature));
-    llama_sampler_chain_add(chain, llama_sampler_init_dist(0));
+// Run one dummy batch of the configured size so compute buffers are
+// allocated and weight pages faulted in before the first real request
+static bool
+warmup_context (bare_llama_context_t *ctx) {
+  uint32_t n_tokens = ctx->is_embedding ? llama_n_ubatch(ctx->ctx) : llama_n_batch(ctx->ctx);
+  if (n_tokens > llama_n_ctx(ctx->ctx)) n_tokens = llama_n_ctx(ctx->ctx);
 
-    // Process initial prompt batch
-    struct llama_batch batch = llama_batch_init(n_tokens, 0, 1);
-    batch.n_tokens = result_tokens;
+  llama_token token = llama_token_bos(ctx->model);
+  if (token < 0) token = llama_token_eos(ctx->model);
+  if (token < 0) token = 0;
 
-    // Set up initial batch with prompt
-    for (int i = 0; i < result_tokens; i++) {
-    batch.token[i] = tokens[i];
+  struct llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+
+  for (uint32_t i = 0; i < n_tokens; i++) {
+    batch.token[i] = token;
     batch.pos[i] = i;
     batch.n_seq_id[i] = 1;
     batch.seq_id[i][0] = 0;
-    batch.logits[i] = (i == result_tokens - 1); // Only last token needs logits
+    batch.logits[i] = i == n_tokens - 1;
+  }
+
+  batch.n_tokens = n_tokens;
+
+  bool ok = true;
+
+  if (llama_model_has_encoder(ctx->model) && llama_encode(ctx->ctx, batch) != 0) ok = false;
+  if (ok && llama_model_has_decoder(ctx->model) && llama_decode(ctx->ctx, batch) != 0) ok = false;
+
+  llama_batch_free(batch);
+
+  llama_synchronize(ctx->ctx);
+  llama_kv_cache_clear(ctx->ctx);
+  llama_perf_context_reset(ctx->ctx);
+
+  return ok;
+}
+
+static js_value_t *
+bare_llama_context_create (js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 3; // instance, model instance, and options object
+  js_value_t *argv[3];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  bare_llama_model_t *model;
+  err = js_unwrap(env, argv[1], (void **) &model);
+  assert(err == 0);
+
+  // Set up default context params
+  struct llama_context_params params = llama_context_default_params();
+  params.n_ctx = 2048;
+  params.n_batch = 512;
+
+  // Parse options
+  bool is_embedding = false;
+  int64_t embedding_cache_size = 0;
+  bool warmup = false;
+  bool has_max_sequences = false;
+  int64_t session_idle_timeout = 0;
+  int64_t session_memory_limit = INT64_MAX;
+  char *spill_dir = NULL;
+  if (argc > 2 && !is_nullish(env, argv[2])) {
+    get_bool_option(env, argv[2], "embedding", &is_embedding);
+    get_int64_option(env, argv[2], "embeddingCacheSize", &embedding_cache_size);
+    get_uint32_option(env, argv[2], "contextSize", &params.n_ctx);
+    get_uint32_option(env, argv[2], "batchSize", &params.n_batch);
+    get_uint32_option(env, argv[2], "ubatchSize", &params.n_ubatch);
+    has_max_sequences = get_uint32_option(env, argv[2], "maxSequences", &params.n_seq_max);
+    get_bool_option(env, argv[2], "flashAttention", &params.flash_attn);
+    get_bool_option(env, argv[2], "warmup", &warmup);
+    get_int64_option(env, argv[2], "sessionIdleTimeout", &session_idle_timeout);
+    get_int64_option(env, argv[2], "sessionMemoryLimit", &session_memory_limit);
+
+    js_value_t *spill_dir_val;
+    if (js_get_named_property(env, argv[2], "sessionSpillDirectory", &spill_dir_val) == 0 && !is_nullish(env, spill_dir_val)) {
+      spill_dir = get_string_value(env, spill_dir_val);
     }
 
-    // Process initial batch
-    int ret = llama_decode(ctx->ctx, batch);
+    char type_name[16];
+    if (get_string_option(env, argv[2], "cacheTypeK", type_name, sizeof(type_name)) && !get_cache_type(type_name, &params.type_k)) {
+      free(spill_dir);
+      err = js_throw_error(env, NULL, "Unsupported K cache type");
+      assert(err == 0);
+      return NULL;
+    }
 
-    if (ret != 0) {
-        free(tokens);
-        free(text);
-        llama_batch_free(batch);
-        llama_sampler_free(chain);
-        err = js_throw_error(env, NULL, "Failed to process initial text");
-        assert(err == 0);
-        return NULL;
+    if (get_string_option(env, argv[2], "cacheTypeV", type_name, sizeof(type_name)) && !get_cache_type(type_name, &params.type_v)) {
+      free(spill_dir);
+      err = js_throw_error(env, NULL, "Unsupported V cache type");
+      assert(err == 0);
+      return NULL;
+    }
+
+    if (get_string_option(env, argv[2], "pooling", type_name, sizeof(type_name)) && !get_pooling_type(type_name, &params.pooling_type)) {
+      free(spill_dir);
+      err = js_throw_error(env, NULL, "Unsupported pooling type");
+      assert(err == 0);
+      return NULL;
+    }
+  }
+
+  // llama.cpp can only dequantize the V cache inside the flash attention kernel
+  if (ggml_is_quantized(params.type_v) && !params.flash_attn) {
+    free(spill_dir);
+    err = js_throw_error(env, NULL, "Quantized V cache requires flashAttention");
+    assert(err == 0);
+    return NULL;
+  }
+
+  if (params.n_ubatch > params.n_batch) {
+    params.n_ubatch = params.n_batch;
+  }
+
+  // Rerank packs each query/document pair into its own sequence, a single
+  // sequence would decode every document on its own
+  enum llama_pooling_type pooling_type = params.pooling_type;
+  if (pooling_type == LLAMA_POOLING_TYPE_UNSPECIFIED) {
+    pooling_type = (enum llama_pooling_type) get_model_meta_int(model->model, "pooling_type", LLAMA_POOLING_TYPE_UNSPECIFIED);
+  }
+
+  if (is_embedding && pooling_type == LLAMA_POOLING_TYPE_RANK && !has_max_sequences) {
+    params.n_seq_max = BARE_LLAMA_RERANK_SEQUENCES;
+  }
+
+  // Set mode-specific params
+  if (is_embedding) {
+    params.embeddings = true;
+    params.logits_all = false;
+  } else {
+    params.embeddings = false;
+    params.logits_all = false;
+  }
+
+  // Refuse before allocating anything, a context that does not fit would
+  // otherwise take the whole process down
+  uint32_t n_ctx = params.n_ctx > 0 ? params.n_ctx : (uint32_t) llama_n_ctx_train(model->model);
+  uint64_t memory_size = get_context_memory_size(model->model, &params, n_ctx);
+  if (is_embedding && embedding_cache_size > 0) memory_size += (uint64_t) embedding_cache_size;
+
+  if (!memory_reserve(&bare_llama_memory.contexts, memory_size)) {
+    free(spill_dir);
+    err = js_throw_error(env, "ERR_MEMORY_LIMIT", "Context exceeds the memory limit");
+    assert(err == 0);
+    return NULL;
+  }
+
+  struct llama_context *llama_ctx = llama_new_context_with_model(model->model, params);
+
+  if (llama_ctx == NULL) {
+    memory_track(&bare_llama_memory.contexts, -(int64_t) memory_size);
+    free(spill_dir);
+    err = js_throw_error(env, NULL, "Failed to create context");
+    assert(err == 0);
+    return NULL;
+  }
+
+  bare_llama_context_t *ctx = calloc(1, sizeof(bare_llama_context_t));
+  ctx->ctx = llama_ctx;
+  ctx->refs = 1;
+  ctx->model = model->model;
+  ctx->owner = model;
+  model->refs++;
+  ctx->sessions = calloc(llama_n_seq_max(llama_ctx), sizeof(bare_llama_session_t *));
+  ctx->embedding_cache = is_embedding && embedding_cache_size > 0 ? embedding_cache_init((size_t) embedding_cache_size, llama_n_embd(model->model)) : NULL;
+  ctx->is_embedding = is_embedding;
+  ctx->flash_attn = params.flash_attn;
+  ctx->type_k = params.type_k;
+  ctx->type_v = params.type_v;
+  ctx->kv_size = get_kv_cache_size(model->model, llama_n_ctx(llama_ctx), params.type_k, params.type_v);
+  ctx->session_idle_timeout = session_idle_timeout > 0 ? (uint64_t) session_idle_timeout : 0;
+  ctx->session_memory_limit = session_memory_limit > 0 ? (size_t) session_memory_limit : 0;
+  ctx->spill_dir = spill_dir;
+  ctx->memory_size = memory_size;
+
+  if (warmup) {
+    uint64_t start = uv_hrtime();
+
+    if (!warmup_context(ctx)) {
+      bare_llama_context_teardown(ctx);
+      err = js_throw_error(env, NULL, "Failed to warm up context");
+      assert(err == 0);
+      return NULL;
+    }
+
+    ctx->warmup_time = (uv_hrtime() - start) / 1e6;
+  }
+
+  err = js_wrap(env, argv[0], ctx, bare_llama_context_finalize, NULL, NULL);
+  assert(err == 0);
+
+  err = js_add_teardown_callback(env, bare_llama_context_teardown, (void *) ctx);
+  assert(err == 0);
+
+  return NULL;
+}
+
+static js_value_t *
+create_embedding_cache_stats (js_env_t *env, bare_llama_embedding_cache_t *cache) {
+  int err;
+
+  js_value_t *result;
+  err = js_create_object(env, &result);
+  assert(err == 0);
+
+#define V(name, value) \
+  { \
+    js_value_t *val; \
+    err = js_create_int64(env, (int64_t) value, &val); \
+    assert(err == 0); \
+    err = js_set_named_property(env, result, name, val); \
+    assert(err == 0); \
+  }
+
+  V("entries", cache->n_entries)
+  V("size", cache->size)
+  V("maxSize", cache->max_size)
+  V("hits", cache->hits)
+  V("misses", cache->misses)
+#undef V
+
+  return result;
+}
+
+static js_value_t *
+bare_llama_context_get_metadata (js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 1;
+  js_value_t *argv[1];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc == 1);
+
+  bare_llama_context_t *ctx;
+  err = js_unwrap(env, argv[0], (void **) &ctx);
+  assert(err == 0);
+
+  js_value_t *result;
+  err = js_create_object(env, &result);
+  assert(err == 0);
+
+#define V(name, fn, value) \
+  { \
+    js_value_t *val; \
+    err = fn(env, value, &val); \
+    assert(err == 0); \
+    err = js_set_named_property(env, result, name, val); \
+    assert(err == 0); \
+  }
+
+  V("embedding", js_get_boolean, ctx->is_embedding)
+  V("contextSize", js_create_uint32, llama_n_ctx(ctx->ctx))
+  V("batchSize", js_create_uint32, llama_n_batch(ctx->ctx))
+  V("ubatchSize", js_create_uint32, llama_n_ubatch(ctx->ctx))
+  V("maxSequences", js_create_uint32, llama_n_seq_max(ctx->ctx))
+  V("flashAttention", js_get_boolean, ctx->flash_attn)
+  V("kvCacheSize", js_create_int64, (int64_t) ctx->kv_size)
+  V("warmupTime", js_create_double, ctx->warmup_time)
+  V("memorySize", js_create_int64, (int64_t) ctx->memory_size)
+#undef V
+
+  if (ctx->embedding_cache) {
+    err = js_set_named_property(env, result, "embeddingCache", create_embedding_cache_stats(env, ctx->embedding_cache));
+    assert(err == 0);
+  }
+
+  const char *pooling = get_pooling_type_name(llama_pooling_type(ctx->ctx));
+
+  js_value_t *pooling_val;
+  err = js_create_string_utf8(env, (const utf8_t *) pooling, strlen(pooling), &pooling_val);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "pooling", pooling_val);
+  assert(err == 0);
+
+  const char *type_k = get_cache_type_name(ctx->type_k);
+  const char *type_v = get_cache_type_name(ctx->type_v);
+
+  js_value_t *type_k_val;
+  err = js_create_string_utf8(env, (const utf8_t *) type_k, strlen(type_k), &type_k_val);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "cacheTypeK", type_k_val);
+  assert(err == 0);
+
+  js_value_t *type_v_val;
+  err = js_create_string_utf8(env, (const utf8_t *) type_v, strlen(type_v), &type_v_val);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "cacheTypeV", type_v_val);
+  assert(err == 0);
+
+  return result;
+}
+
+static js_value_t *
+create_embedding_result (js_env_t *env, const float *embeddings, int n_embd, bool normalize) {
+  int err;
+
+  double norm = 1;
+
+  if (normalize) {
+    double sum = 0;
+    for (int i = 0; i < n_embd; i++) {
+      sum += (double) embeddings[i] * embeddings[i];
     }
 
-    // Make sure processing is complete
-    llama_synchronize(ctx->ctx);
+    if (sum > 0) norm = sqrt(sum);
+  }
+
+  // Create result Float64Array
+  js_value_t *result;
+  err = js_create_arraybuffer(env, n_embd * sizeof(double), NULL, &result);
+  assert(err == 0);
+
+  double *data;
+  size_t length;
+  err = js_get_arraybuffer_info(env, result, (void **) &data, &length);
+  assert(err == 0);
+
+  // Copy embeddings to result
+  for (int i = 0; i < n_embd; i++) {
+    data[i] = (double) embeddings[i] / norm;
+  }
+
+  return result;
+}
+
+static js_value_t *
+bare_llama_context_save_embedding_cache (js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 2; // context instance and path
+  js_value_t *argv[2];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc == 2);
+
+  bare_llama_context_t *ctx;
+  err = js_unwrap(env, argv[0], (void **) &ctx);
+  assert(err == 0);
+
+  if (ctx->embedding_cache == NULL) {
+    err = js_throw_error(env, NULL, "Context has no embedding cache");
+    assert(err == 0);
+    return NULL;
+  }
+
+  uv_loop_t *loop;
+  err = js_get_env_loop(env, &loop);
+  assert(err == 0);
+
+  char *path = get_string_value(env, argv[1]);
+
+  bool ok = embedding_cache_save(ctx->embedding_cache, get_model_fingerprint(loop, ctx->owner), path);
+
+  free(path);
+
+  if (!ok) {
+    err = js_throw_error(env, NULL, "Failed to save embedding cache");
+    assert(err == 0);
+    return NULL;
+  }
+
+  return NULL;
+}
+
+static js_value_t *
+bare_llama_context_load_embedding_cache (js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 2; // context instance and path
+  js_value_t *argv[2];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc == 2);
+
+  bare_llama_context_t *ctx;
+  err = js_unwrap(env, argv[0], (void **) &ctx);
+  assert(err == 0);
+
+  if (ctx->embedding_cache == NULL) {
+    err = js_throw_error(env, NULL, "Context has no embedding cache");
+    assert(err == 0);
+    return NULL;
+  }
+
+  uv_loop_t *loop;
+  err = js_get_env_loop(env, &loop);
+  assert(err == 0);
+
+  char *path = get_string_value(env, argv[1]);
+
+  bool ok = embedding_cache_load(ctx->embedding_cache, get_model_fingerprint(loop, ctx->owner), path);
+
+  free(path);
+
+  if (!ok) {
+    err = js_throw_error(env, NULL, "Failed to load embedding cache");
+    assert(err == 0);
+    return NULL;
+  }
+
+  return NULL;
+}
+
+static js_value_t *
+bare_llama_context_encode (js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 3;
+  js_value_t *argv[3];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  bare_llama_context_t *ctx;
+  err = js_unwrap(env, argv[0], (void **) &ctx);
+  assert(err == 0);
+
+  if (!ctx->is_embedding) {
+    err = js_throw_error(env, NULL, "Context not configured for embeddings");
+    assert(err == 0);
+    return NULL;
+  }
+
+  bare_llama_token_options_t token_opts;
+  get_token_options(env, argc > 2 ? argv[2] : NULL, &token_opts);
+
+  // First tokenize the input
+  size_t text_len;
+  err = js_get_value_string_utf8(env, argv[1], NULL, 0, &text_len);
+  assert(err == 0);
+
+  utf8_t *text = malloc(text_len + 1);
+  err = js_get_value_string_utf8(env, argv[1], text, text_len + 1, NULL);
+  assert(err == 0);
+
+  // Get tokens
+  int n_tokens = llama_tokenize(ctx->model, (const char *) text, text_len, NULL, 0, token_opts.add_special, token_opts.parse_special);
+  if (n_tokens < 0) {
+    n_tokens = -n_tokens;
+  }
+
+  llama_token *tokens = malloc(n_tokens * sizeof(llama_token));
+  int result_tokens = llama_tokenize(ctx->model, (const char *) text, text_len, tokens, n_tokens, token_opts.add_special, token_opts.parse_special);
+
+  int n_embd = llama_n_embd(ctx->model);
+
+  bool normalize = false;
+  if (argc > 2 && !is_nullish(env, argv[2])) {
+    get_bool_option(env, argv[2], "normalize", &normalize);
+  }
+
+  uint32_t cache_flags = (uint32_t) llama_pooling_type(ctx->ctx) << 1 | normalize;
+  uint64_t cache_hash = 0;
+
+  if (ctx->embedding_cache) {
+    cache_hash = hash_tokens(tokens, result_tokens, cache_flags);
+
+    bare_llama_embedding_entry_t *entry = embedding_cache_get(ctx->embedding_cache, cache_hash, tokens, result_tokens, cache_flags);
+
+    if (entry != NULL) {
+      free(tokens);
+      free(text);
+      return create_embedding_result(env, entry->embd, n_embd, false);
+    }
+  }
+
+  // Drop whatever a previous encode or rerank left in the cache
+  llama_kv_cache_clear(ctx->ctx);
+
+  // Prepare batch
+  struct llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+
+  batch.n_tokens = result_tokens;
+
+  for (int i = 0; i < n_tokens; i++) {
+    batch.token[i] = tokens[i];
+    batch.pos[i] = i;
+    batch.n_seq_id[i] = 1;
+    batch.seq_id[i][0] = 0;
+    batch.logits[i] = false;
+  }
+  // Ask for embeddings for the last token
+  batch.logits[n_tokens - 1] = true;
+
+  // Decode batch
+  int ret = llama_decode(ctx->ctx, batch);
+
+  if (ret != 0) {
+    free(tokens);
+    free(text);
+    llama_batch_free(batch);
+    err = js_throw_error(env, NULL, "Failed to process text");
+    assert(err == 0);
+    return NULL;
+  }
+
+  // Make sure processing is complete
+  llama_synchronize(ctx->ctx);
+
+  enum llama_pooling_type pooling_type = llama_pooling_type(ctx->ctx);
+
+  const float *embeddings = NULL;
+
+  if (pooling_type != LLAMA_POOLING_TYPE_NONE) {
+    embeddings = llama_get_embeddings_seq(ctx->ctx, 0);
+  }
+
+  if (embeddings == NULL) {
+    embeddings = llama_get_embeddings(ctx->ctx);
+  }
+
+  if (embeddings == NULL) {
+    free(tokens);
+    free(text);
+    llama_batch_free(batch);
+    err = js_throw_error(env, NULL, "Failed to get embeddings");
+    assert(err == 0);
+    return NULL;
+  }
+
+  js_value_t *result = create_embedding_result(env, embeddings, n_embd, normalize);
+
+  if (ctx->embedding_cache) {
+    // Cache what was returned, after normalization
+    float *cached = malloc(n_embd * sizeof(float));
+
+    double *data;
+    size_t length;
+    err = js_get_arraybuffer_info(env, result, (void **) &data, &length);
+    assert(err == 0);
+
+    for (int i = 0; i < n_embd; i++) {
+      cached[i] = (float) data[i];
+    }
+
+    embedding_cache_put(ctx->embedding_cache, cache_hash, tokens, result_tokens, cache_flags, cached);
+
+    free(cached);
+  }
+
+  free(tokens);
+  free(text);
+  llama_batch_free(batch);
+
+  return result;
+}
+
+// Collect the sequence ids not owned by a chat session. Stateless calls like
+// generate and score may use these freely and clear them before use.
+static uint32_t
+get_free_sequences (bare_llama_context_t *ctx, llama_seq_id *seq_ids) {
+  uint32_t n_seq_max = llama_n_seq_max(ctx->ctx);
+  uint32_t n_free = 0;
+
+  for (uint32_t i = 0; i < n_seq_max; i++) {
+    if (ctx->sessions[i] == NULL) seq_ids[n_free++] = i;
+  }
+
+  return n_free;
+}
+
+static uint64_t
+get_time_ms (void) {
+  return uv_hrtime() / 1000000;
+}
+
+static void
+link_session (bare_llama_context_t *ctx, bare_llama_session_t *session) {
+  session->prev = NULL;
+  session->next = ctx->sessions_head;
+
+  if (ctx->sessions_head) ctx->sessions_head->prev = session;
+
+  ctx->sessions_head = session;
+}
+
+static void
+unlink_session (bare_llama_context_t *ctx, bare_llama_session_t *session) {
+  if (session->prev) session->prev->next = session->next;
+  else ctx->sessions_head = session->next;
+
+  if (session->next) session->next->prev = session->prev;
+}
+
+// Move an evicted session's in-memory KV snapshot to a spill file
+static bool
+spill_session (bare_llama_context_t *ctx, bare_llama_session_t *session) {
+  size_t len = strlen(ctx->spill_dir) + 64;
+  char *path = malloc(len);
+  snprintf(path, len, "%s/bare-llama-%p-%llu.kv", ctx->spill_dir, (void *) session, (unsigned long long) ++ctx->spill_count);
+
+  FILE *file = fopen(path, "wb");
+  bool ok = file != NULL && fwrite(session->state, 1, session->state_size, file) == session->state_size;
+
+  if (file != NULL && fclose(file) != 0) ok = false;
+
+  if (!ok) {
+    remove(path);
+    free(path);
+    return false;
+  }
+
+  ctx->evicted_size -= session->state_size;
+  memory_track(&bare_llama_memory.sessions, -(int64_t) session->state_size);
+
+  free(session->state);
+  session->state = NULL;
+  session->spill_path = path;
+
+  return true;
+}
+
+// Spill the least recently used in-memory snapshots until they fit under
+// the context's session memory limit
+static void
+enforce_session_memory_limit (bare_llama_context_t *ctx) {
+  if (ctx->spill_dir == NULL) return;
+
+  while (ctx->evicted_size > ctx->session_memory_limit) {
+    bare_llama_session_t *oldest = NULL;
+
+    for (bare_llama_session_t *session = ctx->sessions_head; session != NULL; session = session->next) {
+      if (session->state == NULL) continue;
+      if (oldest == NULL || session->last_used < oldest->last_used) oldest = session;
+    }
+
+    if (oldest == NULL || !spill_session(ctx, oldest)) return;
+  }
+}
+
+// Serialize a session's KV cells into a compact snapshot and give its
+// sequence back to the context. The session keeps its position and history,
+// and is restored on its next turn without re-prefilling.
+static bool
+evict_session (bare_llama_session_t *session) {
+  bare_llama_context_t *ctx = session->context;
+
+  if (session->seq_id < 0) return true;
+
+  if (session->n_past > 0) {
+    size_t size = llama_state_seq_get_size(ctx->ctx, session->seq_id);
+
+    uint8_t *state = malloc(size);
+    size_t written = llama_state_seq_get_data(ctx->ctx, state, size, session->seq_id);
+
+    if (written == 0) {
+      free(state);
+      return false;
+    }
+
+    session->state = state;
+    session->state_size = written;
+
+    ctx->evicted_size += written;
+    memory_track(&bare_llama_memory.sessions, (int64_t) written);
+  }
+
+  llama_kv_cache_seq_rm(ctx->ctx, session->seq_id, -1, -1);
+
+  ctx->sessions[session->seq_id] = NULL;
+  session->seq_id = -1;
+
+  enforce_session_memory_limit(ctx);
+
+  return true;
+}
+
+static void
+evict_idle_sessions (bare_llama_context_t *ctx) {
+  if (ctx->session_idle_timeout == 0) return;
+
+  uint64_t now = get_time_ms();
+
+  for (bare_llama_session_t *session = ctx->sessions_head; session != NULL; session = session->next) {
+    if (session->seq_id >= 0 && now - session->last_used >= ctx->session_idle_timeout) {
+      evict_session(session);
+    }
+  }
+}
+
+// Evict least recently used sessions until n sequences are free, never
+// touching the session asking for room
+static uint32_t
+reserve_free_sequences (bare_llama_context_t *ctx, uint32_t n, bare_llama_session_t *requester) {
+  evict_idle_sessions(ctx);
+
+  uint32_t n_seq_max = llama_n_seq_max(ctx->ctx);
+
+  for (;;) {
+    uint32_t n_free = 0;
+    bare_llama_session_t *oldest = NULL;
+
+    for (uint32_t i = 0; i < n_seq_max; i++) {
+      bare_llama_session_t *session = ctx->sessions[i];
+
+      if (session == NULL) n_free++;
+      else if (session != requester && (oldest == NULL || session->last_used < oldest->last_used)) oldest = session;
+    }
+
+    if (n_free >= n || oldest == NULL || !evict_session(oldest)) return n_free;
+  }
+}
+
+static uint8_t *
+read_spill_file (const char *path, size_t *len) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) return NULL;
+
+  long size = -1;
+  if (fseek(file, 0, SEEK_END) == 0) size = ftell(file);
+
+  if (size <= 0 || fseek(file, 0, SEEK_SET) != 0) {
+    fclose(file);
+    return NULL;
+  }
+
+  uint8_t *state = malloc(size);
+
+  if (fread(state, 1, size, file) != (size_t) size) {
+    free(state);
+    fclose(file);
+    return NULL;
+  }
+
+  fclose(file);
+
+  *len = (size_t) size;
+
+  return state;
+}
+
+// Give an evicted session a sequence again and load its KV snapshot into it
+static bool
+restore_session (bare_llama_session_t *session) {
+  bare_llama_context_t *ctx = session->context;
+
+  if (session->seq_id >= 0) return true;
+
+  if (reserve_free_sequences(ctx, 1, session) == 0) return false;
+
+  llama_seq_id seq_id = -1;
+  for (uint32_t i = llama_n_seq_max(ctx->ctx); i-- > 0;) {
+    if (ctx->sessions[i] == NULL) {
+      seq_id = i;
+      break;
+    }
+  }
+
+  uint8_t *state = session->state;
+  size_t state_size = session->state_size;
+
+  if (session->spill_path) {
+    state = read_spill_file(session->spill_path, &state_size);
+    if (state == NULL) return false;
+  }
+
+  llama_kv_cache_seq_rm(ctx->ctx, seq_id, -1, -1);
+
+  // Keep the snapshot until it is loaded, so a failed restore can be retried
+  // instead of continuing from an empty sequence
+  if (state && llama_state_seq_set_data(ctx->ctx, state, state_size, seq_id) == 0) {
+    llama_kv_cache_seq_rm(ctx->ctx, seq_id, -1, -1);
+    if (state != session->state) free(state);
+    return false;
+  }
+
+  if (session->spill_path) {
+    remove(session->spill_path);
+    free(session->spill_path);
+    session->spill_path = NULL;
+
+    free(state);
+  } else if (session->state) {
+    ctx->evicted_size -= session->state_size;
+    memory_track(&bare_llama_memory.sessions, -(int64_t) session->state_size);
+
+    free(session->state);
+    session->state = NULL;
+    session->state_size = 0;
+  }
+
+  session->seq_id = seq_id;
+  ctx->sessions[seq_id] = session;
+
+  return true;
+}
+
+typedef struct {
+  int32_t max_tokens;
+  float temperature;
+  int32_t top_k;
+  uint32_t seed;
+  uint32_t n;
+  struct llama_sampler *grammar; // Borrowed from the context's grammar cache
+} bare_llama_generate_options_t;
+
+typedef struct {
+  struct llama_sampler *sampler;
+  llama_seq_id seq_id;
+  int32_t i_batch;
+  int32_t n_generated;
+  llama_token last_token;
+  bool done;
+  char *text;
+  size_t text_len;
+  size_t text_size;
+} bare_llama_branch_t;
+
+// Return the compiled grammar sampler cached under a GBNF grammar or JSON
+// schema key, or NULL when it has not been parsed yet.
+static struct llama_sampler *
+find_grammar_sampler (bare_llama_context_t *ctx, const char *key) {
+  uint64_t hash = hash_bytes(0xcbf29ce484222325ULL, key, strlen(key));
+
+  for (int i = 0; i < BARE_LLAMA_GRAMMAR_CACHE_SIZE; i++) {
+    bare_llama_grammar_entry_t *entry = &ctx->grammars[i];
+
+    if (entry->sampler && entry->hash == hash && strcmp(entry->key, key) == 0) {
+      entry->last_used = ++ctx->grammar_clock;
+      return entry->sampler;
+    }
+  }
+
+  return NULL;
+}
+
+// Compile a GBNF grammar and cache it under key. The least recently used
+// entry is replaced once the cache is full.
+static struct llama_sampler *
+add_grammar_sampler (bare_llama_context_t *ctx, const char *key, const char *grammar, const char *root) {
+  uint64_t hash = hash_bytes(0xcbf29ce484222325ULL, key, strlen(key));
+
+  bare_llama_grammar_entry_t *slot = &ctx->grammars[0];
+
+  for (int i = 1; i < BARE_LLAMA_GRAMMAR_CACHE_SIZE; i++) {
+    if (ctx->grammars[i].last_used < slot->last_used) slot = &ctx->grammars[i];
+  }
+
+  struct llama_sampler *sampler = llama_sampler_init_grammar(ctx->model, grammar, root);
+  if (sampler == NULL) return NULL;
+
+  if (slot->sampler) llama_sampler_free(slot->sampler);
+  free(slot->key);
+
+  slot->hash = hash;
+  slot->key = malloc(strlen(key) + 1);
+  memcpy(slot->key, key, strlen(key) + 1);
+  slot->last_used = ++ctx->grammar_clock;
+  slot->sampler = sampler;
+
+  return sampler;
+}
+
+// Implemented in grammar.cc on top of llama.cpp's common library
+char *
+bare_llama_json_schema_to_grammar (const char *schema);
+
+static bool
+get_grammar_option (js_env_t *env, bare_llama_context_t *ctx, js_value_t *options, struct llama_sampler **result) {
+  int err;
+
+  *result = NULL;
+
+  js_value_t *grammar_val;
+  err = js_get_named_property(env, options, "grammar", &grammar_val);
+  assert(err == 0);
+
+  js_value_t *schema_val;
+  err = js_get_named_property(env, options, "jsonSchema", &schema_val);
+  assert(err == 0);
+
+  bool has_grammar = !is_nullish(env, grammar_val);
+  bool has_schema = !is_nullish(env, schema_val);
+
+  if (!has_grammar && !has_schema) return true;
+
+  char root[64] = "root";
+  get_string_option(env, options, "grammarRoot", root, sizeof(root));
+
+  // Prefix keys so a schema and a grammar with the same text never collide
+  char *text = get_string_value(env, has_grammar ? grammar_val : schema_val);
+  size_t key_len = strlen(root) + strlen(text) + 16;
+  char *key = malloc(key_len);
+  snprintf(key, key_len, "%s:%s:%s", has_grammar ? "gbnf" : "schema", root, text);
+
+  *result = find_grammar_sampler(ctx, key);
+
+  if (*result != NULL) {
+    free(key);
+    free(text);
+    return true;
+  }
+
+  char *grammar = text;
+
+  if (!has_grammar) {
+    grammar = bare_llama_json_schema_to_grammar(text);
+
+    if (grammar == NULL) {
+      free(key);
+      free(text);
+      err = js_throw_error(env, NULL, "Failed to convert JSON schema to grammar");
+      assert(err == 0);
+      return false;
+    }
+  }
+
+  *result = add_grammar_sampler(ctx, key, grammar, root);
+
+  if (grammar != text) free(grammar);
+  free(key);
+  free(text);
+
+  if (*result == NULL) {
+    err = js_throw_error(env, NULL, "Failed to parse grammar");
+    assert(err == 0);
+    return false;
+  }
+
+  return true;
+}
+
+static bool
+get_generate_options (js_env_t *env, bare_llama_context_t *ctx, js_value_t *options, bare_llama_generate_options_t *gen_opts) {
+  // Set defaults
+  gen_opts->max_tokens = 20;
+  gen_opts->temperature = 0.8f;
+  gen_opts->top_k = 40;
+  gen_opts->seed = 0;
+  gen_opts->n = 1;
+  gen_opts->grammar = NULL;
+
+  if (options == NULL || is_nullish(env, options)) return true;
+
+  get_int32_option(env, options, "maxTokens", &gen_opts->max_tokens);
+  get_int32_option(env, options, "topK", &gen_opts->top_k);
+  get_uint32_option(env, options, "seed", &gen_opts->seed);
+  get_uint32_option(env, options, "n", &gen_opts->n);
+
+  double temperature;
+  if (get_double_option(env, options, "temperature", &temperature)) {
+    gen_opts->temperature = (float) temperature;
+  }
+
+  return get_grammar_option(env, ctx, options, &gen_opts->grammar);
+}
+
+static llama_token *
+tokenize_text (js_env_t *env, struct llama_model *model, js_value_t *value, bare_llama_token_options_t *token_opts, int *n_tokens) {
+  int err;
+
+  size_t text_len;
+  err = js_get_value_string_utf8(env, value, NULL, 0, &text_len);
+  assert(err == 0);
+
+  utf8_t *text = malloc(text_len + 1);
+  err = js_get_value_string_utf8(env, value, text, text_len + 1, NULL);
+  assert(err == 0);
+
+  int n = llama_tokenize(model, (const char *) text, text_len, NULL, 0, token_opts->add_special, token_opts->parse_special);
+  if (n < 0) n = -n;
+
+  llama_token *tokens = malloc((n > 0 ? n : 1) * sizeof(llama_token));
+  *n_tokens = llama_tokenize(model, (const char *) text, text_len, tokens, n, token_opts->add_special, token_opts->parse_special);
+
+  free(text);
+
+  return tokens;
+}
+
+static void
+batch_add (struct llama_batch *batch, llama_token token, llama_pos pos, const llama_seq_id *seq_ids, int32_t n_seq_ids, bool logits) {
+  int32_t i = batch->n_tokens;
+
+  batch->token[i] = token;
+  batch->pos[i] = pos;
+  batch->n_seq_id[i] = n_seq_ids;
+  for (int32_t j = 0; j < n_seq_ids; j++) {
+    batch->seq_id[i][j] = seq_ids[j];
+  }
+  batch->logits[i] = logits;
+
+  batch->n_tokens++;
+}
+
+// Decode tokens into a single sequence in chunks of at most n_batch tokens,
+// requesting logits only for the final token. On success the logits of the
+// final token are at index batch->n_tokens - 1.
+static int
+decode_tokens (struct llama_context *ctx, struct llama_batch *batch, const llama_token *tokens, int n_tokens, llama_seq_id seq_id, llama_pos pos) {
+  int n_batch = llama_n_batch(ctx);
+
+  for (int i = 0; i < n_tokens; i += n_batch) {
+    int n = n_tokens - i < n_batch ? n_tokens - i : n_batch;
+
+    batch->n_tokens = 0;
+
+    for (int j = 0; j < n; j++) {
+      batch_add(batch, tokens[i + j], pos + i + j, &seq_id, 1, i + j == n_tokens - 1);
+    }
+
+    int ret = llama_decode(ctx, *batch);
+    if (ret != 0) return ret;
+  }
+
+  return 0;
+}
+
+static struct llama_sampler *
+create_sampler (bare_llama_generate_options_t *gen_opts, uint32_t seed) {
+  struct llama_sampler_chain_params chain_params = llama_sampler_chain_default_params();
+  struct llama_sampler *chain = llama_sampler_chain_init(chain_params);
+  if (gen_opts->grammar) llama_sampler_chain_add(chain, llama_sampler_clone(gen_opts->grammar));
+  llama_sampler_chain_add(chain, llama_sampler_init_top_k(gen_opts->top_k));
+  llama_sampler_chain_add(chain, llama_sampler_init_temp(gen_opts->temperature));
+  llama_sampler_chain_add(chain, llama_sampler_init_dist(seed));
+  return chain;
+}
+
+// Run all branches in lockstep, one token per branch per llama_decode. Each
+// branch must have i_batch pointing at the logits it samples its first token
+// from, and n_past is the position that token will be decoded at.
+static void
+generate_branches (struct llama_context *ctx, struct llama_model *model, struct llama_batch *batch, bare_llama_branch_t *branches, uint32_t n_branches, llama_pos n_past, int32_t max_tokens) {
+  char piece[256];
+
+  for (llama_pos pos = n_past;; pos++) {
+    batch->n_tokens = 0;
+
+    for (uint32_t i = 0; i < n_branches; i++) {
+      bare_llama_branch_t *branch = &branches[i];
+      if (branch->done) continue;
+
+      llama_token token = llama_sampler_sample(branch->sampler, ctx, branch->i_batch);
+
+      branch->last_token = token;
+
+      if (llama_token_is_eog(model, token)) {
+        branch->done = true;
+        continue;
+      }
+
+      int piece_len = llama_token_to_piece(model, token, piece, sizeof(piece), 0, true);
+
+      if (piece_len > 0) {
+        if (branch->text_len + piece_len > branch->text_size) {
+          while (branch->text_len + piece_len > branch->text_size) branch->text_size *= 2;
+          branch->text = realloc(branch->text, branch->text_size);
+        }
+
+        memcpy(branch->text + branch->text_len, piece, piece_len);
+        branch->text_len += piece_len;
+      }
+
+      if (++branch->n_generated >= max_tokens) {
+        branch->done = true;
+        continue;
+      }
+
+      branch->i_batch = batch->n_tokens;
+      batch_add(batch, token, pos, &branch->seq_id, 1, true);
+    }
+
+    if (batch->n_tokens == 0) break;
+
+    if (llama_decode(ctx, *batch) != 0) break;
+  }
+}
+
+static js_value_t *
+bare_llama_context_generate (js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 4; // context instance, text, and options
+  js_value_t *argv[4];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  bare_llama_context_t *ctx;
+  err = js_unwrap(env, argv[0], (void **) &ctx);
+  assert(err == 0);
+
+  if (ctx->is_embedding) {
+    err = js_throw_error(env, NULL, "Context not configured for generation");
+    assert(err == 0);
+    return NULL;
+  }
+
+  bare_llama_token_options_t token_opts;
+  get_token_options(env, argc > 3 ? argv[3] : NULL, &token_opts);
+
+  bare_llama_generate_options_t gen_opts;
+  if (!get_generate_options(env, ctx, argc > 2 ? argv[2] : NULL, &gen_opts)) return NULL;
+
+  reserve_free_sequences(ctx, gen_opts.n, NULL);
+
+  llama_seq_id *seq_ids = malloc(llama_n_seq_max(ctx->ctx) * sizeof(llama_seq_id));
+  uint32_t n_free = get_free_sequences(ctx, seq_ids);
+
+  if (gen_opts.n == 0 || gen_opts.n > n_free) {
+    free(seq_ids);
+    err = js_throw_error(env, NULL, "Number of completions exceeds the free sequences, increase maxSequences");
+    assert(err == 0);
+    return NULL;
+  }
+
+  int n_tokens;
+  llama_token *tokens = tokenize_text(env, ctx->model, argv[1], &token_opts, &n_tokens);
+
+  if (n_tokens <= 0) {
+    free(seq_ids);
+    free(tokens);
+    err = js_throw_error(env, NULL, "Failed to tokenize prompt");
+    assert(err == 0);
+    return NULL;
+  }
+
+  // Start every branch from an empty sequence
+  for (uint32_t i = 0; i < gen_opts.n; i++) {
+    llama_kv_cache_seq_rm(ctx->ctx, seq_ids[i], -1, -1);
+  }
+
+  uint32_t n_batch = llama_n_batch(ctx->ctx);
+  struct llama_batch batch = llama_batch_init(n_batch > gen_opts.n ? n_batch : gen_opts.n, 0, 1);
+
+  // Prefill the prompt once into the first branch's sequence
+  int ret = decode_tokens(ctx->ctx, &batch, tokens, n_tokens, seq_ids[0], 0);
+
+  free(tokens);
+
+  if (ret != 0) {
+    llama_kv_cache_seq_rm(ctx->ctx, seq_ids[0], -1, -1);
+    free(seq_ids);
+    llama_batch_free(batch);
+    err = js_throw_error(env, NULL, "Failed to process initial text");
+    assert(err == 0);
+    return NULL;
+  }
+
+  // Share the prompt's KV cells with every other branch
+  for (uint32_t i = 1; i < gen_opts.n; i++) {
+    llama_kv_cache_seq_cp(ctx->ctx, seq_ids[0], seq_ids[i], -1, -1);
+  }
+
+  bare_llama_branch_t *branches = calloc(gen_opts.n, sizeof(bare_llama_branch_t));
+
+  for (uint32_t i = 0; i < gen_opts.n; i++) {
+    branches[i].sampler = create_sampler(&gen_opts, gen_opts.seed + i);
+    branches[i].seq_id = seq_ids[i];
+    branches[i].i_batch = batch.n_tokens - 1;
+    branches[i].text_size = 1024;
+    branches[i].text = malloc(branches[i].text_size);
+  }
+
+  generate_branches(ctx->ctx, ctx->model, &batch, branches, gen_opts.n, n_tokens, gen_opts.max_tokens);
+
+  // Give the branch cells back to the unified cache, sessions count on every
+  // cell they do not hold being free
+  for (uint32_t i = 0; i < gen_opts.n; i++) {
+    llama_kv_cache_seq_rm(ctx->ctx, seq_ids[i], -1, -1);
+  }
+
+  js_value_t *result = NULL;
+
+  if (gen_opts.n > 1) {
+    err = js_create_array_with_length(env, gen_opts.n, &result);
+    assert(err == 0);
+  }
+
+  for (uint32_t i = 0; i < gen_opts.n; i++) {
+    js_value_t *text;
+    err = js_create_string_utf8(env, (utf8_t *) branches[i].text, branches[i].text_len, &text);
+    assert(err == 0);
+
+    if (gen_opts.n > 1) {
+      err = js_set_element(env, result, i, text);
+      assert(err == 0);
+    } else {
+      result = text;
+    }
+
+    free(branches[i].text);
+    llama_sampler_free(branches[i].sampler);
+  }
+
+  free(branches);
+  free(seq_ids);
+  llama_batch_free(batch);
+
+  return result;
+}
+
+typedef struct {
+  llama_token token;
+  float logprob;
+} bare_llama_token_logprob_t;
+
+typedef struct {
+  llama_token *tokens;
+  int n_tokens;
+  llama_seq_id seq_id;
+  int32_t i_batch;
+  float *logprobs;
+  bare_llama_token_logprob_t *alternatives;
+} bare_llama_candidate_t;
+
+// Log-probability of token under the softmax of logits, optionally filling
+// alternatives with the top_k most likely tokens in descending order.
+static float
+get_token_logprob (const float *logits, int32_t n_vocab, llama_token token, bare_llama_token_logprob_t *alternatives, int32_t top_k) {
+  float max = logits[0];
+  for (int32_t i = 1; i < n_vocab; i++) {
+    if (logits[i] > max) max = logits[i];
+  }
+
+  double sum = 0;
+  for (int32_t i = 0; i < n_vocab; i++) {
+    sum += exp(logits[i] - max);
+  }
+
+  float log_sum = max + (float) log(sum);
+
+  for (int32_t k = 0; k < top_k; k++) {
+    alternatives[k].token = -1;
+    alternatives[k].logprob = -INFINITY;
+  }
+
+  for (int32_t i = 0; i < n_vocab && top_k > 0; i++) {
+    float logprob = logits[i] - log_sum;
+    if (logprob <= alternatives[top_k - 1].logprob) continue;
+
+    int32_t k = top_k - 1;
+    while (k > 0 && alternatives[k - 1].logprob < logprob) {
+      alternatives[k] = alternatives[k - 1];
+      k--;
+    }
+
+    alternatives[k].token = i;
+    alternatives[k].logprob = logprob;
+  }
+
+  return logits[token] - log_sum;
+}
+
+static js_value_t *
+create_token_logprob (js_env_t *env, bare_llama_token_logprob_t *entry) {
+  int err;
+
+  js_value_t *result;
+  err = js_create_object(env, &result);
+  assert(err == 0);
+
+  js_value_t *token;
+  err = js_create_int32(env, entry->token, &token);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "token", token);
+  assert(err == 0);
+
+  js_value_t *logprob;
+  err = js_create_double(env, entry->logprob, &logprob);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "logprob", logprob);
+  assert(err == 0);
+
+  return result;
+}
+
+static js_value_t *
+create_candidate_score (js_env_t *env, bare_llama_candidate_t *candidate, int32_t top_k) {
+  int err;
+
+  js_value_t *result;
+  err = js_create_object(env, &result);
+  assert(err == 0);
+
+  js_value_t *tokens;
+  err = js_create_array_with_length(env, candidate->n_tokens, &tokens);
+  assert(err == 0);
+
+  js_value_t *logprobs;
+  err = js_create_array_with_length(env, candidate->n_tokens, &logprobs);
+  assert(err == 0);
+
+  js_value_t *alternatives = NULL;
+  if (top_k > 0) {
+    err = js_create_array_with_length(env, candidate->n_tokens, &alternatives);
+    assert(err == 0);
+  }
+
+  double total = 0;
+
+  for (int i = 0; i < candidate->n_tokens; i++) {
+    js_value_t *val;
+    err = js_create_int32(env, candidate->tokens[i], &val);
+    assert(err == 0);
+
+    err = js_set_element(env, tokens, i, val);
+    assert(err == 0);
+
+    err = js_create_double(env, candidate->logprobs[i], &val);
+    assert(err == 0);
+
+    err = js_set_element(env, logprobs, i, val);
+    assert(err == 0);
+
+    total += candidate->logprobs[i];
+
+    if (alternatives == NULL) continue;
+
+    js_value_t *position;
+    err = js_create_array_with_length(env, top_k, &position);
+    assert(err == 0);
+
+    for (int32_t k = 0; k < top_k; k++) {
+      err = js_set_element(env, position, k, create_token_logprob(env, &candidate->alternatives[i * top_k + k]));
+      assert(err == 0);
+    }
+
+    err = js_set_element(env, alternatives, i, position);
+    assert(err == 0);
+  }
+
+  err = js_set_named_property(env, result, "tokens", tokens);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "logprobs", logprobs);
+  assert(err == 0);
+
+  js_value_t *val;
+  err = js_create_double(env, total, &val);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "logprob", val);
+  assert(err == 0);
+
+  err = js_create_double(env, candidate->n_tokens > 0 ? exp(-total / candidate->n_tokens) : 1, &val);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "perplexity", val);
+  assert(err == 0);
+
+  if (alternatives != NULL) {
+    err = js_set_named_property(env, result, "alternatives", alternatives);
+    assert(err == 0);
+  }
+
+  return result;
+}
+
+static void
+free_candidates (bare_llama_candidate_t *candidates, uint32_t n_candidates) {
+  for (uint32_t i = 0; i < n_candidates; i++) {
+    free(candidates[i].tokens);
+    free(candidates[i].logprobs);
+    free(candidates[i].alternatives);
+  }
+
+  free(candidates);
+}
+
+static js_value_t *
+bare_llama_context_score (js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 4; // context instance, prompt, candidates, and options
+  js_value_t *argv[4];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc >= 3);
+
+  bare_llama_context_t *ctx;
+  err = js_unwrap(env, argv[0], (void **) &ctx);
+  assert(err == 0);
+
+  if (ctx->is_embedding) {
+    err = js_throw_error(env, NULL, "Context not configured for generation");
+    assert(err == 0);
+    return NULL;
+  }
+
+  js_value_t *options = argc > 3 ? argv[3] : NULL;
+
+  bare_llama_token_options_t token_opts;
+  get_token_options(env, options, &token_opts);
+
+  int32_t top_k = 0;
+  if (options != NULL && !is_nullish(env, options)) {
+    get_int32_option(env, options, "topK", &top_k);
+  }
+
+  if (top_k < 0) top_k = 0;
+
+  int n_prompt;
+  llama_token *prompt = tokenize_text(env, ctx->model, argv[1], &token_opts, &n_prompt);
+
+  if (n_prompt <= 0) {
+    free(prompt);
+    err = js_throw_error(env, NULL, "Prompt must contain at least one token");
+    assert(err == 0);
+    return NULL;
+  }
+
+  // Candidates continue the prompt, so never prefix them with BOS
+  bare_llama_token_options_t candidate_opts = token_opts;
+  candidate_opts.add_special = false;
+
+  uint32_t n_candidates;
+  err = js_get_array_length(env, argv[2], &n_candidates);
+  assert(err == 0);
+
+  bare_llama_candidate_t *candidates = calloc(n_candidates > 0 ? n_candidates : 1, sizeof(bare_llama_candidate_t));
+
+  for (uint32_t i = 0; i < n_candidates; i++) {
+    js_value_t *val;
+    err = js_get_element(env, argv[2], i, &val);
+    assert(err == 0);
+
+    bare_llama_candidate_t *candidate = &candidates[i];
+    candidate->tokens = tokenize_text(env, ctx->model, val, &candidate_opts, &candidate->n_tokens);
+    if (candidate->n_tokens < 0) candidate->n_tokens = 0;
+    candidate->logprobs = malloc((candidate->n_tokens + 1) * sizeof(float));
+    candidate->alternatives = malloc((candidate->n_tokens + 1) * (top_k + 1) * sizeof(bare_llama_token_logprob_t));
+  }
+
+  reserve_free_sequences(ctx, 1, NULL);
+
+  llama_seq_id *seq_ids = malloc(llama_n_seq_max(ctx->ctx) * sizeof(llama_seq_id));
+  uint32_t n_free = get_free_sequences(ctx, seq_ids);
+
+  if (n_free == 0) {
+    free(seq_ids);
+    free(prompt);
+    free_candidates(candidates, n_candidates);
+    err = js_throw_error(env, NULL, "No free sequence, increase maxSequences");
+    assert(err == 0);
+    return NULL;
+  }
+
+  uint32_t n_batch = llama_n_batch(ctx->ctx);
+  int32_t n_vocab = llama_n_vocab(ctx->model);
+
+  for (uint32_t s = 0; s < n_free; s++) {
+    llama_kv_cache_seq_rm(ctx->ctx, seq_ids[s], -1, -1);
+  }
+
+  struct llama_batch batch = llama_batch_init(n_batch, 0, 1);
+
+  int ret = decode_tokens(ctx->ctx, &batch, prompt, n_prompt, seq_ids[0], 0);
+
+  free(prompt);
+
+  if (ret != 0) {
+    llama_kv_cache_seq_rm(ctx->ctx, seq_ids[0], -1, -1);
+    free(seq_ids);
+    llama_batch_free(batch);
+    free_candidates(candidates, n_candidates);
+    err = js_throw_error(env, NULL, "Failed to process prompt");
+    assert(err == 0);
+    return NULL;
+  }
+
+  // The prompt's final logits predict the first token of every candidate
+  float *prompt_logits = malloc(n_vocab * sizeof(float));
+  memcpy(prompt_logits, llama_get_logits_ith(ctx->ctx, batch.n_tokens - 1), n_vocab * sizeof(float));
+
+  // Pack as many candidates as there are free sequences and batch room into
+  // each decode. The first free sequence holds the prompt and is extended in
+  // place, the others share its KV cells through llama_kv_cache_seq_cp.
+  uint32_t next = 0;
+
+  while (next < n_candidates) {
+    uint32_t first = next;
+    uint32_t n_seq = 0;
+    bool needs_logits = false;
+
+    batch.n_tokens = 0;
+
+    while (next < n_candidates && n_seq < n_free) {
+      bare_llama_candidate_t *candidate = &candidates[next];
+
+      if (candidate->n_tokens == 0) {
+        next++;
+        continue;
+      }
+
+      if (batch.n_tokens + candidate->n_tokens > (int32_t) n_batch) break;
+
+      candidate->seq_id = seq_ids[n_seq];
+      candidate->i_batch = batch.n_tokens;
+
+      // Single token candidates are fully scored by the prompt logits
+      if (candidate->n_tokens > 1) needs_logits = true;
+
+      if (n_seq > 0) {
+        llama_kv_cache_seq_cp(ctx->ctx, seq_ids[0], candidate->seq_id, -1, -1);
+      }
+
+      n_seq++;
+
+      for (int i = 0; i < candidate->n_tokens; i++) {
+        batch_add(&batch, candidate->tokens[i], n_prompt + i, &candidate->seq_id, 1, i < candidate->n_tokens - 1);
+      }
+
+      next++;
+    }
+
+    if (next == first) {
+      for (uint32_t s = 0; s < n_free; s++) {
+        llama_kv_cache_seq_rm(ctx->ctx, seq_ids[s], -1, -1);
+      }
+
+      free(seq_ids);
+      llama_batch_free(batch);
+      free(prompt_logits);
+      free_candidates(candidates, n_candidates);
+      err = js_throw_error(env, NULL, "Candidate exceeds batchSize");
+      assert(err == 0);
+      return NULL;
+    }
+
+    if (needs_logits && llama_decode(ctx->ctx, batch) != 0) {
+      for (uint32_t s = 0; s < n_free; s++) {
+        llama_kv_cache_seq_rm(ctx->ctx, seq_ids[s], -1, -1);
+      }
+
+      free(seq_ids);
+      llama_batch_free(batch);
+      free(prompt_logits);
+      free_candidates(candidates, n_candidates);
+      err = js_throw_error(env, NULL, "Failed to process candidates");
+      assert(err == 0);
+      return NULL;
+    }
+
+    for (uint32_t c = first; c < next; c++) {
+      bare_llama_candidate_t *candidate = &candidates[c];
+
+      for (int i = 0; i < candidate->n_tokens; i++) {
+        const float *logits = i == 0 ? prompt_logits : llama_get_logits_ith(ctx->ctx, candidate->i_batch + i - 1);
+
+        candidate->logprobs[i] = get_token_logprob(logits, n_vocab, candidate->tokens[i], &candidate->alternatives[i * top_k], top_k);
+      }
+    }
+
+    // Drop the candidate cells, keeping only the shared prompt
+    llama_kv_cache_seq_rm(ctx->ctx, seq_ids[0], n_prompt, -1);
+
+    for (uint32_t s = 1; s < n_seq; s++) {
+      llama_kv_cache_seq_rm(ctx->ctx, seq_ids[s], -1, -1);
+    }
+  }
+
+  // Give the prompt cells back to the unified cache
+  llama_kv_cache_seq_rm(ctx->ctx, seq_ids[0], -1, -1);
+
+  js_value_t *result;
+  err = js_create_array_with_length(env, n_candidates, &result);
+  assert(err == 0);
+
+  for (uint32_t i = 0; i < n_candidates; i++) {
+    err = js_set_element(env, result, i, create_candidate_score(env, &candidates[i], top_k));
+    assert(err == 0);
+  }
+
+  free(seq_ids);
+  llama_batch_free(batch);
+  free(prompt_logits);
+  free_candidates(candidates, n_candidates);
+
+  return result;
+}
+
+typedef struct {
+  uint32_t index;
+  float score;
+} bare_llama_rank_t;
+
+static int
+compare_ranks (const void *a, const void *b) {
+  float score_a = ((const bare_llama_rank_t *) a)->score;
+  float score_b = ((const bare_llama_rank_t *) b)->score;
+
+  if (score_a != score_b) return (score_a < score_b) - (score_a > score_b);
+
+  // qsort is not stable, keep equal scores in input order
+  uint32_t index_a = ((const bare_llama_rank_t *) a)->index;
+  uint32_t index_b = ((const bare_llama_rank_t *) b)->index;
+
+  return (index_a > index_b) - (index_a < index_b);
+}
+
+// Build the cross-encoder input for one query/document pair in the layout
+// llama.cpp rerankers expect: [BOS] query [EOS] [SEP] document [EOS]. Special
+// tokens the model does not have are left out, as llama.cpp does.
+static llama_token *
+create_rerank_tokens (struct llama_model *model, const llama_token *query, int n_query, const llama_token *doc, int n_doc, int *n_tokens) {
+  llama_token *tokens = malloc((n_query + n_doc + 4) * sizeof(llama_token));
+  int n = 0;
+
+  llama_token bos = llama_token_bos(model);
+  llama_token eos = llama_token_eos(model);
+  llama_token sep = llama_token_sep(model);
+
+  if (bos >= 0) tokens[n++] = bos;
+  memcpy(tokens + n, query, n_query * sizeof(llama_token));
+  n += n_query;
+  if (eos >= 0) tokens[n++] = eos;
+  if (sep >= 0) tokens[n++] = sep;
+  memcpy(tokens + n, doc, n_doc * sizeof(llama_token));
+  n += n_doc;
+  if (eos >= 0) tokens[n++] = eos;
+
+  *n_tokens = n;
+
+  return tokens;
+}
+
+static js_value_t *
+bare_llama_context_rerank (js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 4; // context instance, query, documents, and options
+  js_value_t *argv[4];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc >= 3);
+
+  bare_llama_context_t *ctx;
+  err = js_unwrap(env, argv[0], (void **) &ctx);
+  assert(err == 0);
+
+  if (!ctx->is_embedding || llama_pooling_type(ctx->ctx) != LLAMA_POOLING_TYPE_RANK) {
+    err = js_throw_error(env, NULL, "Context not configured for reranking");
+    assert(err == 0);
+    return NULL;
+  }
+
+  js_value_t *options = argc > 3 ? argv[3] : NULL;
+
+  bare_llama_token_options_t token_opts;
+  get_token_options(env, options, &token_opts);
+
+  // The pair layout already adds the special tokens
+  token_opts.add_special = false;
+
+  uint32_t top_k = 0;
+  if (options != NULL && !is_nullish(env, options)) {
+    get_uint32_option(env, options, "topK", &top_k);
+  }
+
+  int n_query;
+  llama_token *query = tokenize_text(env, ctx->model, argv[1], &token_opts, &n_query);
+  if (n_query < 0) n_query = 0;
+
+  uint32_t n_docs;
+  err = js_get_array_length(env, argv[2], &n_docs);
+  assert(err == 0);
+
+  // Non-causal models must see a whole sequence in one physical batch
+  uint32_t n_batch = llama_n_ubatch(ctx->ctx);
+  uint32_t n_seq_max = llama_n_seq_max(ctx->ctx);
+
+  struct llama_batch batch = llama_batch_init(n_batch, 0, 1);
+
+  bare_llama_rank_t *ranks = malloc((n_docs > 0 ? n_docs : 1) * sizeof(bare_llama_rank_t));
+
+  uint32_t next = 0;
+
+  // A pair that did not fit the previous batch starts the next one
+  llama_token *tokens = NULL;
+  int n_tokens = 0;
+
+  while (next < n_docs) {
+    uint32_t first = next;
+    llama_seq_id n_seq = 0;
+
+    llama_kv_cache_clear(ctx->ctx);
+    batch.n_tokens = 0;
+
+    while (next < n_docs && n_seq < (llama_seq_id) n_seq_max) {
+      if (tokens == NULL) {
+        js_value_t *val;
+        err = js_get_element(env, argv[2], next, &val);
+        assert(err == 0);
+
+        int n_doc;
+        llama_token *doc = tokenize_text(env, ctx->model, val, &token_opts, &n_doc);
+        if (n_doc < 0) n_doc = 0;
+
+        tokens = create_rerank_tokens(ctx->model, query, n_query, doc, n_doc, &n_tokens);
+
+        free(doc);
+      }
+
+      if (batch.n_tokens + n_tokens > (int32_t) n_batch) break;
+
+      for (int i = 0; i < n_tokens; i++) {
+        batch_add(&batch, tokens[i], i, &n_seq, 1, i == n_tokens - 1);
+      }
+
+      free(tokens);
+      tokens = NULL;
+
+      n_seq++;
+      next++;
+    }
+
+    if (next == first) {
+      free(tokens);
+      free(query);
+      free(ranks);
+      llama_batch_free(batch);
+      err = js_throw_error(env, NULL, "Query and document exceed ubatchSize");
+      assert(err == 0);
+      return NULL;
+    }
+
+    if (llama_decode(ctx->ctx, batch) != 0) {
+      free(tokens);
+      free(query);
+      free(ranks);
+      llama_batch_free(batch);
+      err = js_throw_error(env, NULL, "Failed to process documents");
+      assert(err == 0);
+      return NULL;
+    }
+
+    for (llama_seq_id s = 0; s < n_seq; s++) {
+      const float *embd = llama_get_embeddings_seq(ctx->ctx, s);
+
+      ranks[first + s].index = first + s;
+      ranks[first + s].score = embd != NULL ? embd[0] : -INFINITY;
+    }
+  }
+
+  llama_kv_cache_clear(ctx->ctx);
+
+  qsort(ranks, n_docs, sizeof(bare_llama_rank_t), compare_ranks);
+
+  uint32_t n_results = top_k > 0 && top_k < n_docs ? top_k : n_docs;
+
+  js_value_t *result;
+  err = js_create_array_with_length(env, n_results, &result);
+  assert(err == 0);
+
+  for (uint32_t i = 0; i < n_results; i++) {
+    js_value_t *entry;
+    err = js_create_object(env, &entry);
+    assert(err == 0);
+
+    js_value_t *val;
+    err = js_create_uint32(env, ranks[i].index, &val);
+    assert(err == 0);
+
+    err = js_set_named_property(env, entry, "index", val);
+    assert(err == 0);
+
+    err = js_create_double(env, ranks[i].score, &val);
+    assert(err == 0);
+
+    err = js_set_named_property(env, entry, "score", val);
+    assert(err == 0);
+
+    err = js_set_element(env, result, i, entry);
+    assert(err == 0);
+  }
+
+  free(query);
+  free(ranks);
+  llama_batch_free(batch);
+
+  return result;
+}
+
+static void
+bare_llama_session_teardown (void *data) {
+  bare_llama_session_t *session = (bare_llama_session_t *) data;
+  bare_llama_context_t *ctx = session->context;
+
+  if (session->seq_id >= 0) {
+    llama_kv_cache_seq_rm(ctx->ctx, session->seq_id, -1, -1);
+    ctx->sessions[session->seq_id] = NULL;
+  }
+
+  if (session->state) {
+    ctx->evicted_size -= session->state_size;
+    memory_track(&bare_llama_memory.sessions, -(int64_t) session->state_size);
+  }
+
+  if (session->spill_path) remove(session->spill_path);
+
+  unlink_session(ctx, session);
+
+  for (size_t i = 0; i < session->n_messages; i++) {
+    free(session->messages[i].role);
+    free(session->messages[i].content);
+  }
+
+  free(session->messages);
+  free(session->template);
+  free(session->state);
+  free(session->spill_path);
+  free(session);
+
+  bare_llama_context_teardown(ctx);
+}
+
+static void
+bare_llama_session_finalize (js_env_t *env, void *data, void *finalize_hint) {
+  int err;
+
+  bare_llama_session_teardown(data);
+
+  err = js_remove_teardown_callback(env, bare_llama_session_teardown, data);
+  assert(err == 0);
+}
+
+static js_value_t *
+bare_llama_session_create (js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 3; // instance, context instance, and options object
+  js_value_t *argv[3];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  bare_llama_context_t *ctx;
+  err = js_unwrap(env, argv[1], (void **) &ctx);
+  assert(err == 0);
+
+  if (ctx->is_embedding) {
+    err = js_throw_error(env, NULL, "Context not configured for generation");
+    assert(err == 0);
+    return NULL;
+  }
+
+  uint32_t n_seq_max = llama_n_seq_max(ctx->ctx);
+  uint32_t seq_id = n_seq_max;
+  char *template = NULL;
+
+  if (argc > 2 && !is_nullish(env, argv[2])) {
+    get_uint32_option(env, argv[2], "sequence", &seq_id);
+
+    js_value_t *template_val;
+    if (js_get_named_property(env, argv[2], "template", &template_val) == 0 && !is_nullish(env, template_val)) {
+      template = get_string_value(env, template_val);
+    }
+  }
+
+  bool is_explicit = seq_id != n_seq_max;
+
+  // Without an explicit sequence, take the highest free one so stateless
+  // calls keep using the low ids. When none is free the session starts out
+  // evicted and claims one on its first turn.
+  if (!is_explicit) {
+    seq_id = -1;
+
+    for (uint32_t i = n_seq_max; i-- > 0;) {
+      if (ctx->sessions[i] == NULL) {
+        seq_id = i;
+        break;
+      }
+    }
+  }
+
+  if (is_explicit && (seq_id >= n_seq_max || ctx->sessions[seq_id] != NULL)) {
+    free(template);
+    err = js_throw_error(env, NULL, "No free sequence for session, increase maxSequences");
+    assert(err == 0);
+    return NULL;
+  }
+
+  bare_llama_session_t *session = calloc(1, sizeof(bare_llama_session_t));
+  session->context = ctx;
+  session->seq_id = (llama_seq_id) seq_id;
+  session->n_past = 0;
+  session->messages_size = 8;
+  session->messages = malloc(session->messages_size * sizeof(bare_llama_message_t));
+  session->n_messages = 0;
+  session->n_formatted = 0;
+  session->template = template;
+  session->last_used = get_time_ms();
+
+  ctx->refs++;
+
+  link_session(ctx, session);
+
+  if (session->seq_id >= 0) {
+    ctx->sessions[session->seq_id] = session;
+
+    llama_kv_cache_seq_rm(ctx->ctx, session->seq_id, -1, -1);
+  }
+
+  err = js_wrap(env, argv[0], session, bare_llama_session_finalize, NULL, NULL);
+  assert(err == 0);
+
+  err = js_add_teardown_callback(env, bare_llama_session_teardown, (void *) session);
+  assert(err == 0);
+
+  return NULL;
+}
+
+static js_value_t *
+bare_llama_session_destroy (js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 1; // session instance
+  js_value_t *argv[1];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc == 1);
+
+  bare_llama_session_t *session;
+  err = js_remove_wrap(env, argv[0], (void **) &session);
+  assert(err == 0);
+
+  err = js_remove_teardown_callback(env, bare_llama_session_teardown, (void *) session);
+  assert(err == 0);
+
+  bare_llama_session_teardown((void *) session);
+
+  return NULL;
+}
+
+static js_value_t *
+bare_llama_session_add_message (js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 3; // session instance, role, and content
+  js_value_t *argv[3];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc == 3);
+
+  bare_llama_session_t *session;
+  err = js_unwrap(env, argv[0], (void **) &session);
+  assert(err == 0);
+
+  if (session->n_messages == session->messages_size) {
+    session->messages_size *= 2;
+    session->messages = realloc(session->messages, session->messages_size * sizeof(bare_llama_message_t));
+  }
+
+  bare_llama_message_t *message = &session->messages[session->n_messages++];
+  message->role = get_string_value(env, argv[1]);
+  message->content = get_string_value(env, argv[2]);
+
+  return NULL;
+}
+
+// Apply the chat template to the whole history. Formatting is cheap string
+// work, only the part past n_formatted is ever tokenized and decoded.
+static char *
+format_session (bare_llama_session_t *session, bool add_assistant, int32_t *len) {
+  llama_chat_message *chat = malloc((session->n_messages > 0 ? session->n_messages : 1) * sizeof(llama_chat_message));
+
+  for (size_t i = 0; i < session->n_messages; i++) {
+    chat[i].role = session->messages[i].role;
+    chat[i].content = session->messages[i].content;
+  }
+
+  int32_t size = 1024;
+  char *formatted = malloc(size);
+
+  int32_t n = llama_chat_apply_template(session->context->model, session->template, chat, session->n_messages, add_assistant, formatted, size);
+
+  if (n > size) {
+    size = n;
+    formatted = realloc(formatted, size);
+    n = llama_chat_apply_template(session->context->model, session->template, chat, session->n_messages, add_assistant, formatted, size);
+  }
+
+  free(chat);
+
+  if (n < 0) {
+    free(formatted);
+    return NULL;
+  }
+
+  *len = n;
+
+  return formatted;
+}
+
+static js_value_t *
+bare_llama_session_generate (js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 2; // session instance and options
+  js_value_t *argv[2];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  bare_llama_session_t *session;
+  err = js_unwrap(env, argv[0], (void **) &session);
+  assert(err == 0);
+
+  bare_llama_context_t *ctx = session->context;
+
+  bare_llama_generate_options_t gen_opts;
+  if (!get_generate_options(env, ctx, argc > 1 ? argv[1] : NULL, &gen_opts)) return NULL;
+
+  int32_t n_formatted;
+  char *formatted = format_session(session, true, &n_formatted);
+
+  if (formatted == NULL) {
+    err = js_throw_error(env, NULL, "Failed to apply chat template");
+    assert(err == 0);
+    return NULL;
+  }
+
+  // Tokenize only what was appended since the last turn
+  const char *text = formatted + session->n_formatted;
+  int32_t text_len = n_formatted - session->n_formatted;
+  bool add_special = session->n_past == 0;
+
+  int n_tokens = llama_tokenize(ctx->model, text, text_len, NULL, 0, add_special, true);
+  if (n_tokens < 0) n_tokens = -n_tokens;
+
+  llama_token *tokens = malloc((n_tokens > 0 ? n_tokens : 1) * sizeof(llama_token));
+  n_tokens = llama_tokenize(ctx->model, text, text_len, tokens, n_tokens, add_special, true);
+
+  free(formatted);
+
+  if (n_tokens <= 0) {
+    free(tokens);
+    err = js_throw_error(env, NULL, "No new messages to reply to");
+    assert(err == 0);
+    return NULL;
+  }
+
+  if (session->n_past + n_tokens + gen_opts.max_tokens > (llama_pos) llama_n_ctx(ctx->ctx)) {
+    free(tokens);
+    err = js_throw_error(env, NULL, "Session exceeds contextSize");
+    assert(err == 0);
+    return NULL;
+  }
+
+  session->last_used = get_time_ms();
+
+  evict_idle_sessions(ctx);
+
+  if (!restore_session(session)) {
+    free(tokens);
+    err = js_throw_error(env, NULL, "Failed to restore evicted session");
+    assert(err == 0);
+    return NULL;
+  }
+
+  struct llama_batch batch = llama_batch_init(llama_n_batch(ctx->ctx), 0, 1);
+
+  int ret = decode_tokens(ctx->ctx, &batch, tokens, n_tokens, session->seq_id, session->n_past);
+
+  free(tokens);
+
+  if (ret != 0) {
+    // Drop the chunks that did decode so the sequence matches n_past
+    llama_kv_cache_seq_rm(ctx->ctx, session->seq_id, session->n_past, -1);
+    llama_batch_free(batch);
+    err = js_throw_error(env, NULL, "Failed to process messages");
+    assert(err == 0);
+    return NULL;
+  }
+
+  session->n_past += n_tokens;
+
+  llama_pos n_prompt_past = session->n_past;
+  int32_t n_prompt = n_formatted;
+
+  bare_llama_branch_t branch = {
+    .sampler = create_sampler(&gen_opts, gen_opts.seed),
+    .seq_id = session->seq_id,
+    .i_batch = batch.n_tokens - 1,
+    .text_size = 1024,
+    .text = malloc(1024),
+  };
+
+  generate_branches(ctx->ctx, ctx->model, &batch, &branch, 1, session->n_past, gen_opts.max_tokens);
+
+  session->n_past = llama_kv_cache_seq_pos_max(ctx->ctx, session->seq_id) + 1;
+
+  // The final sampled token is never decoded by the generation loop. When it
+  // is content, cut off by maxTokens, decode it so the cache holds exactly
+  // the reply text. An end of turn token is left to the template instead.
+  if (!llama_token_is_eog(ctx->model, branch.last_token)) {
+    batch.n_tokens = 0;
+    batch_add(&batch, branch.last_token, session->n_past, &session->seq_id, 1, true);
+
+    if (llama_decode(ctx->ctx, batch) == 0) session->n_past++;
+  }
+
+  llama_sampler_free(branch.sampler);
+
+  if (session->n_messages == session->messages_size) {
+    session->messages_size *= 2;
+    session->messages = realloc(session->messages, session->messages_size * sizeof(bare_llama_message_t));
+  }
+
+  bare_llama_message_t *message = &session->messages[session->n_messages++];
+  message->role = strdup("assistant");
+  message->content = malloc(branch.text_len + 1);
+  memcpy(message->content, branch.text, branch.text_len);
+  message->content[branch.text_len] = '\0';
+
+  formatted = format_session(session, false, &n_formatted);
+
+  if (formatted != NULL) {
+    int32_t n_reply = n_prompt + (int32_t) branch.text_len;
+
+    if (n_reply <= n_formatted && memcmp(formatted + n_prompt, branch.text, branch.text_len) == 0) {
+      // The cache ends where the reply text ends, so the template's closing
+      // markup after it is decoded with the next turn
+      session->n_formatted = n_reply;
+    } else {
+      // The template rewrote the reply, decode its rendering instead of the
+      // sampled tokens so the cache matches the history exactly
+      llama_kv_cache_seq_rm(ctx->ctx, session->seq_id, n_prompt_past, -1);
+      session->n_past = n_prompt_past;
+      session->n_formatted = n_prompt;
+
+      text = formatted + n_prompt;
+      text_len = n_formatted - n_prompt;
+
+      n_tokens = llama_tokenize(ctx->model, text, text_len, NULL, 0, false, true);
+      if (n_tokens < 0) n_tokens = -n_tokens;
+
+      tokens = malloc((n_tokens > 0 ? n_tokens : 1) * sizeof(llama_token));
+      n_tokens = llama_tokenize(ctx->model, text, text_len, tokens, n_tokens, false, true);
+
+      if (n_tokens > 0 && decode_tokens(ctx->ctx, &batch, tokens, n_tokens, session->seq_id, session->n_past) == 0) {
+        session->n_past += n_tokens;
+        session->n_formatted = n_formatted;
+      } else {
+        llama_kv_cache_seq_rm(ctx->ctx, session->seq_id, session->n_past, -1);
+      }
+
+      free(tokens);
+    }
+
+    free(formatted);
+  } else {
+    // Without a rendering there is no offset to continue from, start over
+    // so the next turn prefills the whole history
+    llama_kv_cache_seq_rm(ctx->ctx, session->seq_id, -1, -1);
+    session->n_past = 0;
+    session->n_formatted = 0;
+  }
+
+  llama_batch_free(batch);
+
+  js_value_t *result;
+  err = js_create_string_utf8(env, (utf8_t *) branch.text, branch.text_len, &result);
+  assert(err == 0);
+
+  free(branch.text);
+
+  return result;
+}
+
+static js_value_t *
+bare_llama_session_reset (js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 1;
+  js_value_t *argv[1];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc == 1);
+
+  bare_llama_session_t *session;
+  err = js_unwrap(env, argv[0], (void **) &session);
+  assert(err == 0);
+
+  for (size_t i = 0; i < session->n_messages; i++) {
+    free(session->messages[i].role);
+    free(session->messages[i].content);
+  }
+
+  session->n_messages = 0;
+  session->n_formatted = 0;
+  session->n_past = 0;
+
+  if (session->state) {
+    session->context->evicted_size -= session->state_size;
+    memory_track(&bare_llama_memory.sessions, -(int64_t) session->state_size);
+
+    free(session->state);
+    session->state = NULL;
+    session->state_size = 0;
+  }
+
+  if (session->spill_path) {
+    remove(session->spill_path);
+    free(session->spill_path);
+    session->spill_path = NULL;
+  }
+
+  if (session->seq_id >= 0) llama_kv_cache_seq_rm(session->context->ctx, session->seq_id, -1, -1);
+
+  return NULL;
+}
+
+static js_value_t *
+bare_llama_session_get_metadata (js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 1;
+  js_value_t *argv[1];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc == 1);
+
+  bare_llama_session_t *session;
+  err = js_unwrap(env, argv[0], (void **) &session);
+  assert(err == 0);
+
+  js_value_t *result;
+  err = js_create_object(env, &result);
+  assert(err == 0);
+
+#define V(name, fn, value) \
+  { \
+    js_value_t *val; \
+    err = fn(env, value, &val); \
+    assert(err == 0); \
+    err = js_set_named_property(env, result, name, val); \
+    assert(err == 0); \
+  }
+
+  V("sequence", js_create_int32, session->seq_id)
+  V("position", js_create_int32, session->n_past)
+  V("messages", js_create_uint32, (uint32_t) session->n_messages)
+  V("stateSize", js_create_int64, (int64_t) session->state_size)
+
+  js_value_t *evicted;
+  err = js_get_boolean(env, session->seq_id < 0, &evicted);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "evicted", evicted);
+  assert(err == 0);
+
+  js_value_t *spilled;
+  err = js_get_boolean(env, session->spill_path != NULL, &spilled);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "spilled", spilled);
+  assert(err == 0);
+#undef V
+
+  return result;
+}
+
+static js_value_t *
+bare_llama_session_evict (js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 1;
+  js_value_t *argv[1];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc == 1);
+
+  bare_llama_session_t *session;
+  err = js_unwrap(env, argv[0], (void **) &session);
+  assert(err == 0);
+
+  if (!evict_session(session)) {
+    err = js_throw_error(env, NULL, "Failed to evict session");
+    assert(err == 0);
+    return NULL;
+  }
+
+  return NULL;
+}
 
-    const float *logits = llama_get_logits(ctx->ctx);
+static js_value_t *
+bare_llama_context_evict_idle_sessions (js_env_t *env, js_callback_info_t *info) {
+  int err;
 
-    if (logits == NULL) {
-        free(tokens);
-        free(text);
-        llama_batch_free(batch);
-        llama_sampler_free(chain);
-        err = js_throw_error(env, NULL, "No logits available");
-        assert(err == 0);
-        return NULL;
-    }
+  size_t argc = 1;
+  js_value_t *argv[1];
 
-    // Sample first token using the last position
-    llama_token new_token = llama_sampler_sample(chain, ctx->ctx, batch.n_tokens - 1);
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc == 1);
 
-    // Buffer for collecting generated text
-    size_t gen_buffer_size = 1024; // Start with reasonable size
-    char *gen_buffer = malloc(gen_buffer_size);
-    size_t gen_len = 0;
+  bare_llama_context_t *ctx;
+  err = js_unwrap(env, argv[0], (void **) &ctx);
+  assert(err == 0);
 
-    // Get text for first token
-    char token_text[8];
-    int token_len = llama_token_to_piece(ctx->model, new_token, token_text, sizeof(token_text), 0, true);
+  evict_idle_sessions(ctx);
 
-    memcpy(gen_buffer + gen_len, token_text, token_len);
-    gen_len += token_len;
+  return NULL;
+}
 
-    // Continue generating
-    for (int i = 1; i < max_tokens; i++) {
-    // Create new batch for single token
-    struct llama_batch next_batch = llama_batch_init(1, 0, 1);
-    next_batch.n_tokens = 1;
-    next_batch.token[0] = new_token;
-    next_batch.pos[0] = batch.n_tokens + i - 1; // Continue position sequence
-    next_batch.n_seq_id[0] = 1;
-    next_batch.seq_id[0][0] = 0;
-    next_batch.logits[0] = true;
+static js_value_t *
+bare_llama_set_memory_limit (js_env_t *env, js_callback_info_t *info) {
+  int err;
 
-    ret = llama_decode(ctx->ctx, next_batch);
-    if (ret != 0) {
-        break;
-    }
+  size_t argc = 1; // limit in bytes, 0 to disable
+  js_value_t *argv[1];
 
-    llama_synchronize(ctx->ctx);
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc == 1);
 
-    // Sample next token
-    new_token = llama_sampler_sample(chain, ctx->ctx, 0);
+  int64_t limit;
+  err = js_get_value_int64(env, argv[0], &limit);
+  assert(err == 0);
 
-    // Check for special tokens
-    if (llama_token_eos(ctx->model) == new_token) {
-        break;
-    }
+  atomic_store(&bare_llama_memory.limit, limit > 0 ? (uint64_t) limit : 0);
 
-    // Get token text
-    token_len = llama_token_to_piece(ctx->model, new_token, token_text, sizeof(token_text), 0, true);
-
-    // Check for valid token length
-    if (token_len <= 0) {
-        if (token_len <= 0) {
-        token_len = resample_until_valid(
-            chain,
-            ctx->ctx,
-            ctx->model,
-            &new_token,
-            token_text,
-            sizeof(token_text),
-            50
-        );
-
-        if (token_len < 0) {
-            break;
-        }
-        }
-    }
+  return NULL;
+}
 
-    // Check buffer size
-    if (gen_len + token_len >= gen_buffer_size) {
-        size_t old_size = gen_buffer_size;
-        gen_buffer_size *= 2;
-        gen_buffer = realloc(gen_buffer, gen_buffer_size);
-    }
+static js_value_t *
+bare_llama_get_memory_usage (js_env_t *env, js_callback_info_t *info) {
+  int err;
 
-    // Add to buffer
-    memcpy(gen_buffer + gen_len, token_text, token_len);
-    gen_len += token_len;
+  js_value_t *result;
+  err = js_create_object(env, &result);
+  assert(err == 0);
 
-    llama_batch_free(next_batch);
-    }
+#define V(name, value) \
+  { \
+    js_value_t *val; \
+    err = js_create_int64(env, (int64_t) atomic_load(&value), &val); \
+    assert(err == 0); \
+    err = js_set_named_property(env, result, name, val); \
+    assert(err == 0); \
+  }
 
-    // Create final string
-    js_value_t *result;
-    err = js_create_string_utf8(env, (utf8_t *) gen_buffer, gen_len, &result);
-    assert(err == 0);
+  V("limit", bare_llama_memory.limit)
+  V("used", bare_llama_memory.used)
+  V("models", bare_llama_memory.models)
+  V("contexts", bare_llama_memory.contexts)
+  V("sessions", bare_llama_memory.sessions)
+#undef V
 
-    // Cleanup
-    free(gen_buffer);
-    free(tokens);
-    free(text);
-    llama_batch_free(batch);
-    llama_sampler_free(chain);
-    return result;
+  return result;
 }
 
 static void
@@ -573,6 +3170,8 @@ bare_llama_model_teardown (void *data) {
 
   if (--model->refs == 0) {
     llama_free_model(model->model);
+    memory_track(&bare_llama_memory.models, -(int64_t) model->memory_size);
+    free(model->path);
     free(model);
   }
 }
@@ -616,7 +3215,7 @@ bare_llama_model_create (js_env_t *env, js_callback_info_t *info) {
 
   initialize_logging(log_level);
 
-  bare_llama_model_t *model = malloc(sizeof(bare_llama_model_t));
+  bare_llama_model_t *model = calloc(1, sizeof(bare_llama_model_t));
   model->model = NULL;
   model->refs = 1;
 
@@ -629,16 +3228,45 @@ bare_llama_model_create (js_env_t *env, js_callback_info_t *info) {
   return NULL;
 }
 
+// Read the whole model file once so the weights are in the page cache
+// before they are mapped. Unlike the madvise hint llama.cpp gives the
+// mapping, this blocks until every page is resident.
+static bool
+prefetch_file (const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) return false;
+
+#if defined(__linux__)
+  posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fileno(file), 0, 0, POSIX_FADV_WILLNEED);
+#elif defined(__APPLE__)
+  fcntl(fileno(file), F_RDAHEAD, 1);
+#endif
+
+  size_t size = 4 * 1024 * 1024;
+  char *buf = malloc(size);
+
+  while (fread(buf, 1, size, file) == size) {
+  }
+
+  bool ok = ferror(file) == 0;
+
+  free(buf);
+  fclose(file);
+
+  return ok;
+}
+
 static js_value_t *
 bare_llama_model_load (js_env_t *env, js_callback_info_t *info) {
   int err;
 
-  size_t argc = 2;
-  js_value_t *argv[2];
+  size_t argc = 3; // model instance, path, and options object
+  js_value_t *argv[3];
 
   err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
   assert(err == 0);
-  assert(argc == 2);
+  assert(argc >= 2);
 
   bare_llama_model_t *model;
   err = js_unwrap(env, argv[0], (void **) &model);
@@ -656,16 +3284,63 @@ bare_llama_model_load (js_env_t *env, js_callback_info_t *info) {
 
   struct llama_model_params params = llama_model_default_params();
 
-  model->model = llama_load_model_from_file((const char *) path, params);
+  bool prefetch = false;
+  if (argc > 2 && !is_nullish(env, argv[2])) {
+    get_bool_option(env, argv[2], "prefetch", &prefetch);
+    get_bool_option(env, argv[2], "mlock", &params.use_mlock);
+    get_bool_option(env, argv[2], "mmap", &params.use_mmap);
+  }
 
-  free(path);
+  // The file size bounds the weights, check it against the memory limit
+  // before mapping anything
+  uv_loop_t *loop;
+  err = js_get_env_loop(env, &loop);
+  assert(err == 0);
+
+  uv_fs_t req;
+  uint64_t memory_size = uv_fs_stat(loop, &req, (const char *) path, NULL) == 0 ? req.statbuf.st_size : 0;
+  uv_fs_req_cleanup(&req);
+
+  if (!memory_reserve(&bare_llama_memory.models, memory_size)) {
+    free(path);
+    err = js_throw_error(env, "ERR_MEMORY_LIMIT", "Model exceeds the memory limit");
+    assert(err == 0);
+    return NULL;
+  }
+
+  // Only read the file once it is known to fit, a load over the budget
+  // must fail without touching the weights
+  if (prefetch) {
+    uint64_t start = uv_hrtime();
+
+    if (!prefetch_file((const char *) path)) {
+      memory_track(&bare_llama_memory.models, -(int64_t) memory_size);
+      free(path);
+      err = js_throw_error(env, NULL, "Failed to prefetch model");
+      assert(err == 0);
+      return NULL;
+    }
+
+    model->prefetch_time = (uv_hrtime() - start) / 1e6;
+  }
+
+  model->mlock = params.use_mlock;
+  model->model = llama_load_model_from_file((const char *) path, params);
 
   if (model->model == NULL) {
+    free(path);
+    memory_track(&bare_llama_memory.models, -(int64_t) memory_size);
     err = js_throw_error(env, NULL, "Failed to load model");
     assert(err == 0);
     return NULL;
   }
 
+  model->path = (char *) path;
+
+  // Swap the estimate for the size of the tensors actually loaded
+  model->memory_size = llama_model_size(model->model);
+  memory_track(&bare_llama_memory.models, (int64_t) model->memory_size - (int64_t) memory_size);
+
   return NULL;
 }
 
@@ -731,6 +3406,443 @@ bare_llama_model_get_metadata (js_env_t *env, js_callback_info_t *info) {
   err = js_set_named_property(env, result, "contextWindow", n_ctx_train);
   assert(err == 0);
 
+  js_value_t *prefetch_time;
+  err = js_create_double(env, model->prefetch_time, &prefetch_time);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "prefetchTime", prefetch_time);
+  assert(err == 0);
+
+  js_value_t *mlock;
+  err = js_get_boolean(env, model->mlock, &mlock);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "mlock", mlock);
+  assert(err == 0);
+
+  js_value_t *memory_size;
+  err = js_create_int64(env, (int64_t) model->memory_size, &memory_size);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "memorySize", memory_size);
+  assert(err == 0);
+
+  return result;
+}
+
+typedef struct {
+  int32_t ftype;
+  const char *name;
+} bare_llama_file_type_t;
+
+// Values of enum llama_ftype, as stored in general.file_type
+static const bare_llama_file_type_t bare_llama_file_types[] = {
+  {0, "F32"},
+  {1, "F16"},
+  {2, "Q4_0"},
+  {3, "Q4_1"},
+  {7, "Q8_0"},
+  {8, "Q5_0"},
+  {9, "Q5_1"},
+  {10, "Q2_K"},
+  {11, "Q3_K_S"},
+  {12, "Q3_K_M"},
+  {13, "Q3_K_L"},
+  {14, "Q4_K_S"},
+  {15, "Q4_K_M"},
+  {16, "Q5_K_S"},
+  {17, "Q5_K_M"},
+  {18, "Q6_K"},
+  {19, "IQ2_XXS"},
+  {20, "IQ2_XS"},
+  {21, "Q2_K_S"},
+  {22, "IQ3_XS"},
+  {23, "IQ3_XXS"},
+  {24, "IQ1_S"},
+  {25, "IQ4_NL"},
+  {26, "IQ3_S"},
+  {27, "IQ3_M"},
+  {28, "IQ2_S"},
+  {29, "IQ2_M"},
+  {30, "IQ4_XS"},
+  {31, "IQ1_M"},
+  {32, "BF16"},
+  {36, "TQ1_0"},
+  {37, "TQ2_0"},
+};
+
+static const char *
+get_file_type_name (int32_t ftype) {
+  size_t len = sizeof(bare_llama_file_types) / sizeof(bare_llama_file_types[0]);
+
+  for (size_t i = 0; i < len; i++) {
+    if (bare_llama_file_types[i].ftype == ftype) return bare_llama_file_types[i].name;
+  }
+
+  return NULL;
+}
+
+static js_value_t *
+create_gguf_number (js_env_t *env, enum gguf_type type, const void *data, size_t i) {
+  int err;
+
+  double value;
+
+  switch (type) {
+  case GGUF_TYPE_UINT8:
+    value = ((const uint8_t *) data)[i];
+    break;
+  case GGUF_TYPE_INT8:
+    value = ((const int8_t *) data)[i];
+    break;
+  case GGUF_TYPE_UINT16:
+    value = ((const uint16_t *) data)[i];
+    break;
+  case GGUF_TYPE_INT16:
+    value = ((const int16_t *) data)[i];
+    break;
+  case GGUF_TYPE_UINT32:
+    value = ((const uint32_t *) data)[i];
+    break;
+  case GGUF_TYPE_INT32:
+    value = ((const int32_t *) data)[i];
+    break;
+  case GGUF_TYPE_FLOAT32:
+    value = ((const float *) data)[i];
+    break;
+  case GGUF_TYPE_UINT64:
+    value = (double) ((const uint64_t *) data)[i];
+    break;
+  case GGUF_TYPE_INT64:
+    value = (double) ((const int64_t *) data)[i];
+    break;
+  case GGUF_TYPE_FLOAT64:
+    value = ((const double *) data)[i];
+    break;
+  case GGUF_TYPE_BOOL: {
+    js_value_t *result;
+    err = js_get_boolean(env, ((const int8_t *) data)[i] != 0, &result);
+    assert(err == 0);
+    return result;
+  }
+  default:
+    return NULL;
+  }
+
+  js_value_t *result;
+  err = js_create_double(env, value, &result);
+  assert(err == 0);
+
+  return result;
+}
+
+static js_value_t *
+create_gguf_value (js_env_t *env, struct gguf_context *gguf, int key_id, uint32_t max_array_length) {
+  int err;
+
+  enum gguf_type type = gguf_get_kv_type(gguf, key_id);
+
+  js_value_t *result = NULL;
+
+  if (type == GGUF_TYPE_STRING) {
+    const char *str = gguf_get_val_str(gguf, key_id);
+
+    err = js_create_string_utf8(env, (const utf8_t *) str, strlen(str), &result);
+    assert(err == 0);
+  } else if (type == GGUF_TYPE_ARRAY) {
+    enum gguf_type arr_type = gguf_get_arr_type(gguf, key_id);
+    size_t n = gguf_get_arr_n(gguf, key_id);
+
+    // Vocabularies and merges run into the hundreds of thousands of entries,
+    // report only their length past the cut-off
+    if (n > max_array_length) {
+      err = js_create_double(env, (double) n, &result);
+      assert(err == 0);
+      return result;
+    }
+
+    err = js_create_array_with_length(env, n, &result);
+    assert(err == 0);
+
+    const void *data = arr_type == GGUF_TYPE_STRING ? NULL : gguf_get_arr_data(gguf, key_id);
+
+    for (size_t i = 0; i < n; i++) {
+      js_value_t *val;
+
+      if (arr_type == GGUF_TYPE_STRING) {
+        const char *str = gguf_get_arr_str(gguf, key_id, i);
+
+        err = js_create_string_utf8(env, (const utf8_t *) str, strlen(str), &val);
+        assert(err == 0);
+      } else {
+        val = create_gguf_number(env, arr_type, data, i);
+        if (val == NULL) break;
+      }
+
+      err = js_set_element(env, result, i, val);
+      assert(err == 0);
+    }
+  } else if (type == GGUF_TYPE_BOOL) {
+    err = js_get_boolean(env, gguf_get_val_bool(gguf, key_id), &result);
+    assert(err == 0);
+  } else {
+    double value;
+
+    switch (type) {
+    case GGUF_TYPE_UINT8:
+      value = gguf_get_val_u8(gguf, key_id);
+      break;
+    case GGUF_TYPE_INT8:
+      value = gguf_get_val_i8(gguf, key_id);
+      break;
+    case GGUF_TYPE_UINT16:
+      value = gguf_get_val_u16(gguf, key_id);
+      break;
+    case GGUF_TYPE_INT16:
+      value = gguf_get_val_i16(gguf, key_id);
+      break;
+    case GGUF_TYPE_UINT32:
+      value = gguf_get_val_u32(gguf, key_id);
+      break;
+    case GGUF_TYPE_INT32:
+      value = gguf_get_val_i32(gguf, key_id);
+      break;
+    case GGUF_TYPE_FLOAT32:
+      value = gguf_get_val_f32(gguf, key_id);
+      break;
+    case GGUF_TYPE_UINT64:
+      value = (double) gguf_get_val_u64(gguf, key_id);
+      break;
+    case GGUF_TYPE_INT64:
+      value = (double) gguf_get_val_i64(gguf, key_id);
+      break;
+    case GGUF_TYPE_FLOAT64:
+      value = gguf_get_val_f64(gguf, key_id);
+      break;
+    default:
+      return NULL;
+    }
+
+    err = js_create_double(env, value, &result);
+    assert(err == 0);
+  }
+
+  return result;
+}
+
+// Copy a metadata value under a friendlier name, prefixing the key with the
+// architecture when it starts with a dot
+static void
+set_gguf_alias (js_env_t *env, js_value_t *result, js_value_t *metadata, const char *arch, const char *key, const char *name) {
+  int err;
+
+  char full_key[128];
+  if (key[0] == '.') {
+    snprintf(full_key, sizeof(full_key), "%s%s", arch, key);
+  } else {
+    snprintf(full_key, sizeof(full_key), "%s", key);
+  }
+
+  js_value_t *val;
+  err = js_get_named_property(env, metadata, full_key, &val);
+  assert(err == 0);
+
+  if (is_nullish(env, val)) return;
+
+  err = js_set_named_property(env, result, name, val);
+  assert(err == 0);
+}
+
+static js_value_t *
+bare_llama_inspect_model (js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 2; // path and options
+  js_value_t *argv[2];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+  assert(argc >= 1);
+
+  uint32_t max_array_length = 1024;
+  if (argc > 1 && !is_nullish(env, argv[1])) {
+    get_uint32_option(env, argv[1], "maxArrayLength", &max_array_length);
+  }
+
+  char *path = get_string_value(env, argv[0]);
+
+  // Parse the header and tensor infos only, nothing is read past them
+  struct ggml_context *meta = NULL;
+
+  struct gguf_init_params params = {
+    .no_alloc = true,
+    .ctx = &meta,
+  };
+
+  struct gguf_context *gguf = gguf_init_from_file(path, params);
+
+  free(path);
+
+  if (gguf == NULL) {
+    err = js_throw_error(env, NULL, "Failed to read model");
+    assert(err == 0);
+    return NULL;
+  }
+
+  js_value_t *result;
+  err = js_create_object(env, &result);
+  assert(err == 0);
+
+  js_value_t *metadata;
+  err = js_create_object(env, &metadata);
+  assert(err == 0);
+
+  int n_kv = gguf_get_n_kv(gguf);
+
+  for (int i = 0; i < n_kv; i++) {
+    js_value_t *val = create_gguf_value(env, gguf, i, max_array_length);
+    if (val == NULL) continue;
+
+    err = js_set_named_property(env, metadata, gguf_get_key(gguf, i), val);
+    assert(err == 0);
+  }
+
+  int n_tensors = gguf_get_n_tensors(gguf);
+
+  js_value_t *tensors;
+  err = js_create_array_with_length(env, n_tensors, &tensors);
+  assert(err == 0);
+
+  uint64_t tensor_size = 0;
+  uint64_t n_params = 0;
+
+  // Bytes per tensor type, to name the quantization when general.file_type
+  // is missing
+  uint64_t type_size[GGML_TYPE_COUNT] = {0};
+
+  uint32_t i = 0;
+  for (struct ggml_tensor *tensor = ggml_get_first_tensor(meta); tensor != NULL; tensor = ggml_get_next_tensor(meta, tensor)) {
+    size_t size = ggml_nbytes(tensor);
+    const char *name = ggml_get_name(tensor);
+    const char *type = ggml_type_name(tensor->type);
+
+    tensor_size += size;
+    n_params += ggml_nelements(tensor);
+    if (tensor->type < GGML_TYPE_COUNT) type_size[tensor->type] += size;
+
+    js_value_t *entry;
+    err = js_create_object(env, &entry);
+    assert(err == 0);
+
+    js_value_t *val;
+    err = js_create_string_utf8(env, (const utf8_t *) name, strlen(name), &val);
+    assert(err == 0);
+
+    err = js_set_named_property(env, entry, "name", val);
+    assert(err == 0);
+
+    err = js_create_string_utf8(env, (const utf8_t *) type, strlen(type), &val);
+    assert(err == 0);
+
+    err = js_set_named_property(env, entry, "type", val);
+    assert(err == 0);
+
+    err = js_create_int64(env, (int64_t) size, &val);
+    assert(err == 0);
+
+    err = js_set_named_property(env, entry, "size", val);
+    assert(err == 0);
+
+    err = js_set_element(env, tensors, i++, entry);
+    assert(err == 0);
+  }
+
+  const char *arch = "";
+  int arch_id = gguf_find_key(gguf, "general.architecture");
+  if (arch_id >= 0 && gguf_get_kv_type(gguf, arch_id) == GGUF_TYPE_STRING) {
+    arch = gguf_get_val_str(gguf, arch_id);
+  }
+
+  set_gguf_alias(env, result, metadata, arch, "general.architecture", "architecture");
+  set_gguf_alias(env, result, metadata, arch, "general.name", "name");
+  set_gguf_alias(env, result, metadata, arch, ".context_length", "contextWindow");
+  set_gguf_alias(env, result, metadata, arch, ".embedding_length", "embeddingLength");
+  set_gguf_alias(env, result, metadata, arch, ".block_count", "blockCount");
+  set_gguf_alias(env, result, metadata, arch, ".attention.head_count", "headCount");
+  set_gguf_alias(env, result, metadata, arch, ".attention.head_count_kv", "headCountKv");
+  set_gguf_alias(env, result, metadata, arch, ".vocab_size", "vocabSize");
+  set_gguf_alias(env, result, metadata, arch, "tokenizer.chat_template", "chatTemplate");
+
+  js_value_t *val;
+
+  int vocab_id = gguf_find_key(gguf, "tokenizer.ggml.tokens");
+  if (vocab_id >= 0 && gguf_get_kv_type(gguf, vocab_id) == GGUF_TYPE_ARRAY) {
+    err = js_create_int64(env, gguf_get_arr_n(gguf, vocab_id), &val);
+    assert(err == 0);
+
+    err = js_set_named_property(env, result, "vocabSize", val);
+    assert(err == 0);
+  }
+
+  char key[128];
+  snprintf(key, sizeof(key), "%s.pooling_type", arch);
+
+  int pooling_id = gguf_find_key(gguf, key);
+  if (pooling_id >= 0 && gguf_get_kv_type(gguf, pooling_id) == GGUF_TYPE_UINT32) {
+    const char *pooling = get_pooling_type_name((enum llama_pooling_type) gguf_get_val_u32(gguf, pooling_id));
+
+    err = js_create_string_utf8(env, (const utf8_t *) pooling, strlen(pooling), &val);
+    assert(err == 0);
+
+    err = js_set_named_property(env, result, "pooling", val);
+    assert(err == 0);
+  }
+
+  const char *quantization = NULL;
+
+  int ftype_id = gguf_find_key(gguf, "general.file_type");
+  if (ftype_id >= 0 && gguf_get_kv_type(gguf, ftype_id) == GGUF_TYPE_UINT32) {
+    quantization = get_file_type_name((int32_t) gguf_get_val_u32(gguf, ftype_id));
+  }
+
+  if (quantization == NULL && n_tensors > 0) {
+    enum ggml_type dominant = GGML_TYPE_F32;
+    for (int t = 0; t < GGML_TYPE_COUNT; t++) {
+      if (type_size[t] > type_size[dominant]) dominant = (enum ggml_type) t;
+    }
+
+    quantization = ggml_type_name(dominant);
+  }
+
+  if (quantization != NULL) {
+    err = js_create_string_utf8(env, (const utf8_t *) quantization, strlen(quantization), &val);
+    assert(err == 0);
+
+    err = js_set_named_property(env, result, "quantization", val);
+    assert(err == 0);
+  }
+
+  err = js_create_int64(env, (int64_t) n_params, &val);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "parameters", val);
+  assert(err == 0);
+
+  err = js_create_int64(env, (int64_t) tensor_size, &val);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "tensorSize", val);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "tensors", tensors);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "metadata", metadata);
+  assert(err == 0);
+
+  gguf_free(gguf);
+  ggml_free(meta);
+
   return result;
 }
 
@@ -925,11 +4037,28 @@ bare_llama_exports (js_env_t *env, js_value_t *exports) {
   V("loadModel", bare_llama_model_load)
   V("destroyModel", bare_llama_model_destroy)
   V("getModelMetadata", bare_llama_model_get_metadata)
+  V("inspectModel", bare_llama_inspect_model)
   V("tokenize", bare_llama_model_tokenize)
   V("detokenize", bare_llama_model_detokenize)
   V("createContext", bare_llama_context_create)
+  V("destroyContext", bare_llama_context_destroy)
+  V("getContextMetadata", bare_llama_context_get_metadata)
   V("encode", bare_llama_context_encode)
+  V("saveEmbeddingCache", bare_llama_context_save_embedding_cache)
+  V("loadEmbeddingCache", bare_llama_context_load_embedding_cache)
   V("generate", bare_llama_context_generate)
+  V("score", bare_llama_context_score)
+  V("rerank", bare_llama_context_rerank)
+  V("createSession", bare_llama_session_create)
+  V("destroySession", bare_llama_session_destroy)
+  V("addSessionMessage", bare_llama_session_add_message)
+  V("generateSessionReply", bare_llama_session_generate)
+  V("resetSession", bare_llama_session_reset)
+  V("getSessionMetadata", bare_llama_session_get_metadata)
+  V("evictSession", bare_llama_session_evict)
+  V("evictIdleSessions", bare_llama_context_evict_idle_sessions)
+  V("setMemoryLimit", bare_llama_set_memory_limit)
+  V("getMemoryUsage", bare_llama_get_memory_usage)
 #undef V
 
   return exports;
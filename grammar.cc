@@ -0,0 +1,19 @@
+#include <json-schema-to-grammar.h>
+#include <json.hpp>
+
+#include <stdlib.h>
+#include <string.h>
+
+extern "C" char *
+bare_llama_json_schema_to_grammar (const char *schema) {
+  try {
+    std::string grammar = json_schema_to_grammar(nlohmann::ordered_json::parse(schema));
+
+    char *result = (char *) malloc(grammar.size() + 1);
+    memcpy(result, grammar.c_str(), grammar.size() + 1);
+
+    return result;
+  } catch (...) {
+    return NULL;
+  }
+}
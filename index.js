@@ -8,14 +8,101 @@ const binding = require('./binding.js')
  * @typedef {Object} LlamaContextInstance
  */
 
+/**
+ * @typedef {Object} LlamaSessionInstance
+ */
+
 /**
  * @typedef {Object} LlamaModelInstanceMetadata
  * @property {number} parameters - model parameters
  * @property {number} contextWindow - The context window size
+ * @property {number} prefetchTime - Milliseconds spent prefetching the file, 0 when not prefetched
+ * @property {boolean} mlock - Whether the weights are locked in memory
+ * @property {number} memorySize - Bytes of weights accounted against the memory limit
  */
 
 // TODO: set defaults at the function binding level
 
+/**
+ * @typedef {Object} LlamaMemoryUsage
+ * @property {number} limit - Process memory budget in bytes, 0 when unlimited
+ * @property {number} used - Bytes accounted in total
+ * @property {number} models - Bytes held by loaded model weights
+ * @property {number} contexts - Estimated bytes held by contexts, including KV caches, compute buffers and embedding caches
+ * @property {number} sessions - Bytes held by evicted session snapshots in memory
+ */
+
+/**
+ * Set the process memory budget that `loadModel` and `createContext` are admitted against
+ * @param {number} limit - Budget in bytes, 0 to disable
+ * @returns {void}
+ */
+function setMemoryLimit(limit) {
+  binding.setMemoryLimit(limit)
+  releaseMemory()
+}
+
+/**
+ * Get the memory accounted for models, contexts and evicted sessions across the process
+ * @returns {LlamaMemoryUsage}
+ */
+function getMemoryUsage() {
+  return binding.getMemoryUsage()
+}
+
+/** @type {Array<() => void>} */
+const memoryWaiters = []
+
+/**
+ * Milliseconds between retries while queued, memory freed by garbage collection never wakes the queue
+ * @private
+ */
+const MEMORY_RETRY_INTERVAL = 1000
+
+/**
+ * Wake everything queued on the memory limit so it can retry
+ * @private
+ */
+function releaseMemory() {
+  for (const resolve of memoryWaiters.splice(0)) resolve()
+}
+
+/**
+ * Run an allocation, and when it fails with `ERR_MEMORY_LIMIT` and `options.queue` is set, retry it whenever memory is released or every `MEMORY_RETRY_INTERVAL` milliseconds
+ * @param {() => Promise<void>} allocate
+ * @param {Object} options
+ * @param {boolean} [options.queue=false] - Wait for memory instead of failing fast
+ * @param {number} [options.queueTimeout=0] - Milliseconds to wait before failing, 0 waits forever
+ * @private
+ */
+async function admit(allocate, options = {}) {
+  const deadline = options.queueTimeout > 0 ? Date.now() + options.queueTimeout : Infinity
+
+  while (true) {
+    try {
+      return await allocate()
+    } catch (err) {
+      if (err.code !== 'ERR_MEMORY_LIMIT' || !options.queue) throw err
+
+      const remaining = deadline - Date.now()
+      if (remaining <= 0) throw err
+
+      await new Promise((resolve) => {
+        const timer = setTimeout(done, Math.min(remaining, MEMORY_RETRY_INTERVAL))
+
+        function done() {
+          clearTimeout(timer)
+          const i = memoryWaiters.indexOf(done)
+          if (i !== -1) memoryWaiters.splice(i, 1)
+          resolve()
+        }
+
+        memoryWaiters.push(done)
+      })
+    }
+  }
+}
+
 /**
  * Create a new model instance from a gguf file
  * @param {string} modelFilepath
@@ -33,10 +120,16 @@ async function createModel(modelFilepath, options = { logLevel: 0 }) {
  * Load an existing model instance from its file
  * @param {LlamaModelInstance} model
  * @param {string} modelFilepath
+ * @param {Object} [options={}] - Load options
+ * @param {boolean} [options.prefetch=false] - Read the whole file into the page cache before mapping it, so no weight page faults in lazily
+ * @param {boolean} [options.mlock=false] - Lock the weights in memory so they are never paged out
+ * @param {boolean} [options.mmap=true] - Map the file instead of reading it into allocated buffers
+ * @param {boolean} [options.queue=false] - Wait for memory to be released instead of failing with `ERR_MEMORY_LIMIT`
+ * @param {number} [options.queueTimeout=0] - Milliseconds to wait for memory before failing, 0 waits forever
  * @returns {Promise<void>}
  */
-async function loadModel(model, modelFilepath) {
-  await binding.loadModel(model, modelFilepath)
+async function loadModel(model, modelFilepath, options = {}) {
+  await admit(() => binding.loadModel(model, modelFilepath, options), options)
 }
 
 /**
@@ -46,6 +139,7 @@ async function loadModel(model, modelFilepath) {
  */
 async function destroyModel(model) {
   await binding.destroyModel(model)
+  releaseMemory()
 }
 
 /**
@@ -57,6 +151,43 @@ async function getModelMetadata(model) {
   return binding.getModelMetadata(model)
 }
 
+/**
+ * @typedef {Object} LlamaTensorInfo
+ * @property {string} name - Tensor name
+ * @property {string} type - Tensor data type, such as `q8_0` or `f16`
+ * @property {number} size - Tensor size in bytes
+ */
+
+/**
+ * @typedef {Object} LlamaModelFileInfo
+ * @property {string} [architecture] - Model architecture, such as `llama`
+ * @property {string} [name] - Model name
+ * @property {string} [quantization] - Quantization of the weights, such as `Q8_0` or `Q4_K_M`
+ * @property {number} [contextWindow] - Training context length
+ * @property {number} [embeddingLength] - Embedding dimension
+ * @property {number} [blockCount] - Number of layers
+ * @property {number} [headCount] - Number of attention heads
+ * @property {number} [headCountKv] - Number of key/value heads
+ * @property {number} [vocabSize] - Vocabulary size
+ * @property {string} [pooling] - Embedding pooling type
+ * @property {string} [chatTemplate] - Chat template
+ * @property {number} parameters - Number of parameters
+ * @property {number} tensorSize - Total bytes of tensor data, the weights' memory footprint
+ * @property {LlamaTensorInfo[]} tensors - Every tensor in the file
+ * @property {Object<string, any>} metadata - All GGUF key/value metadata. Arrays longer than `maxArrayLength` are replaced by their length
+ */
+
+/**
+ * Read a GGUF file's header, metadata and tensor infos without loading the weights
+ * @param {string} modelFilepath - Path to the model GGUF file
+ * @param {Object} [options={}] - Inspection options
+ * @param {number} [options.maxArrayLength=1024] - Report longer metadata arrays, such as the vocabulary, by their length only
+ * @returns {Promise<LlamaModelFileInfo>}
+ */
+async function inspectModel(modelFilepath, options = {}) {
+  return binding.inspectModel(modelFilepath, options)
+}
+
 /**
  * Convert text into tokens that the model can understand
  * @param {LlamaModelInstance} model - The model instance
@@ -88,23 +219,72 @@ async function detokenize(model, tokens, options = {}) {
  * @param {LlamaModelInstance} model - The model instance to create a context for
  * @param {Object} [options={}] - Options for context creation
  * @param {boolean} [options.embedding=false] - Whether to create an embedding context (true) or generation context (false)
- * * @param {number} [options.n_ctx=2048] - Maximum tokens in context
- * @param {number} [options.n_batch=512] - Maximum tokens to process in parallel
+ * @param {number} [options.contextSize=2048] - Maximum tokens in context
+ * @param {number} [options.batchSize=512] - Maximum tokens to process in parallel
+ * @param {number} [options.ubatchSize=512] - Maximum tokens per physical compute step, capped at `batchSize`
+ * @param {number} [options.maxSequences=1] - Maximum number of sequences sharing the KV cache, 8 by default for rank pooling contexts
+ * @param {boolean} [options.flashAttention=false] - Use flash attention, required for a quantized V cache
+ * @param {boolean} [options.warmup=false] - Run a dummy decode of `batchSize` tokens before returning, so the first request runs at full speed
+ * @param {string} [options.cacheTypeK='f16'] - KV cache type for keys: `f32`, `f16`, `bf16`, `q8_0`, `q5_1`, `q5_0`, `q4_1` or `q4_0`
+ * @param {string} [options.cacheTypeV='f16'] - KV cache type for values, same choices as `cacheTypeK`, quantized types require `flashAttention`
+ * @param {string} [options.pooling] - Embedding pooling: `none`, `mean`, `cls`, `last` or `rank`, defaults to the model's own
+ * @param {number} [options.embeddingCacheSize=0] - Bytes for an LRU cache of embeddings keyed by tokens, pooling and normalization, 0 disables it
+ * @param {number} [options.sessionIdleTimeout=0] - Milliseconds after which an idle session's KV cache is evicted to a snapshot, 0 disables it
+ * @param {number} [options.sessionMemoryLimit] - Bytes of evicted session snapshots to keep in memory before spilling the oldest to disk
+ * @param {string} [options.sessionSpillDirectory] - Directory for snapshots spilled past `sessionMemoryLimit`, snapshots stay in memory without it
+ * @param {boolean} [options.queue=false] - Wait for memory to be released instead of failing with `ERR_MEMORY_LIMIT`
+ * @param {number} [options.queueTimeout=0] - Milliseconds to wait for memory before failing, 0 waits forever
  * @returns {Promise<LlamaContextInstance>} The created context instance
  */
 async function createContext(model, options = {}) {
   const context = {}
-  await binding.createContext(context, model, options)
+  await admit(() => binding.createContext(context, model, options), options)
   return context
 }
 
+/**
+ * @typedef {Object} LlamaEmbeddingCacheStats
+ * @property {number} entries - Number of cached embeddings
+ * @property {number} size - Bytes used by the cache
+ * @property {number} maxSize - Bytes the cache may use
+ * @property {number} hits - Lookups answered from the cache
+ * @property {number} misses - Lookups that ran the model
+ */
+
+/**
+ * @typedef {Object} LlamaContextInstanceMetadata
+ * @property {boolean} embedding - Whether this is an embedding context
+ * @property {number} contextSize - Number of KV cache cells actually allocated
+ * @property {number} batchSize - Maximum tokens per decode call
+ * @property {number} ubatchSize - Maximum tokens per physical compute step
+ * @property {number} maxSequences - Maximum number of sequences sharing the KV cache
+ * @property {boolean} flashAttention - Whether flash attention is enabled
+ * @property {string} cacheTypeK - KV cache type for keys
+ * @property {string} cacheTypeV - KV cache type for values
+ * @property {string} pooling - Embedding pooling type
+ * @property {LlamaEmbeddingCacheStats} [embeddingCache] - Embedding cache counters, when enabled
+ * @property {number} kvCacheSize - Estimated bytes of the KV cache, from the model's attention shape. Sliding window and recurrent models allocate differently.
+ * @property {number} warmupTime - Milliseconds spent in the warmup decode, 0 when not warmed up
+ * @property {number} memorySize - Estimated bytes accounted against the memory limit
+ */
+
+/**
+ * Get metadata from a context, including the memory its KV cache allocated
+ * @param {LlamaContextInstance} context
+ * @returns {Promise<LlamaContextInstanceMetadata>}
+ */
+async function getContextMetadata(context) {
+  return binding.getContextMetadata(context)
+}
+
 /**
  * Destroy a context instance
  * @param {LlamaContextInstance} context - The context instance to destroy
  * @returns {Promise<void>}
  */
 async function destroyContext(context) {
-  return binding.destroyContext(context)
+  await binding.destroyContext(context)
+  releaseMemory()
 }
 
 /**
@@ -115,10 +295,46 @@ async function destroyContext(context) {
  * @param {Object} [options={}] - Encoding options
  * @param {boolean} [options.addSpecial=false] - Add special tokens to output
  * @param {boolean} [options.parseSpecial=false] - Parse special tokens in text
+ * @param {boolean} [options.normalize=false] - L2-normalize the embedding
  * @returns {Promise<ArrayBuffer>} Array of token embeddings
  */
 async function encode(context, text, options = {}) {
-  return binding.encode(context, text)
+  return binding.encode(context, text, options)
+}
+
+/**
+ * Write a context's embedding cache to disk
+ * @param {LlamaContextInstance} context - An embedding context created with `embeddingCacheSize`
+ * @param {string} filepath - File to write
+ * @returns {Promise<void>}
+ */
+async function saveEmbeddingCache(context, filepath) {
+  return binding.saveEmbeddingCache(context, filepath)
+}
+
+/**
+ * Load embeddings saved by `saveEmbeddingCache` into a context's embedding cache.
+ * Files written for a different model file are rejected, models are told apart by file size and sampled header and weight bytes.
+ * @param {LlamaContextInstance} context - An embedding context created with `embeddingCacheSize`
+ * @param {string} filepath - File to read
+ * @returns {Promise<void>}
+ */
+async function loadEmbeddingCache(context, filepath) {
+  return binding.loadEmbeddingCache(context, filepath)
+}
+
+/**
+ * Serialize a `jsonSchema` object option, compiled grammars are cached natively by its text
+ * @param {Object} options - Generation options
+ * @returns {Object}
+ * @private
+ */
+function grammarOptions(options) {
+  if (options.jsonSchema && typeof options.jsonSchema === 'object') {
+    return { ...options, jsonSchema: JSON.stringify(options.jsonSchema) }
+  }
+
+  return options
 }
 
 /**
@@ -127,12 +343,174 @@ async function encode(context, text, options = {}) {
  * @param {LlamaContextInstance} context - The context instance to use for generation
  * @param {string} prompt - Text prompt to generate from
  * @param {Object} [options={}] - Generation options
+ * @param {number} [options.maxTokens=20] - Maximum tokens to generate per completion, every sampled token counts even when it produces no text
+ * @param {number} [options.temperature=0.8] - Sampling temperature
+ * @param {number} [options.topK=40] - Sample only from the K most likely tokens
+ * @param {number} [options.seed=0] - Sampler seed, completion `i` uses `seed + i`
+ * @param {string} [options.grammar] - GBNF grammar the output must match
+ * @param {string} [options.grammarRoot='root'] - Start rule of `grammar`
+ * @param {Object|string} [options.jsonSchema] - JSON schema the output must match, converted to a grammar natively
+ * @param {number} [options.n=1] - Number of completions decoded in parallel from one prompt prefill, at most the context's `maxSequences`
  * @param {boolean} [options.addSpecial=false] - Add special tokens to output
  * @param {boolean} [options.parseSpecial=false] - Parse special tokens in text
- * @returns {Promise<string>} Generated text
+ * @returns {Promise<string|string[]>} Generated text, or an array of `n` completions when `n > 1`
  */
 async function generate(context, prompt, options = {}) {
-  return binding.generate(context, prompt, options)
+  return binding.generate(context, prompt, grammarOptions(options))
+}
+
+/**
+ * @typedef {Object} LlamaTokenLogprob
+ * @property {number} token - Token ID
+ * @property {number} logprob - Natural log-probability of the token
+ */
+
+/**
+ * @typedef {Object} LlamaCandidateScore
+ * @property {number[]} tokens - Candidate token IDs
+ * @property {number[]} logprobs - Log-probability of each candidate token given everything before it
+ * @property {number} logprob - Sum of `logprobs`, the log-probability of the whole candidate
+ * @property {number} perplexity - Per-token perplexity of the candidate
+ * @property {LlamaTokenLogprob[][]} [alternatives] - The `topK` most likely tokens at each position
+ */
+
+/**
+ * Score how likely each candidate continuation of a prompt is.
+ * The prompt is decoded once and its KV cache is shared by all candidates, which are packed into as few batches as the context's `maxSequences` and `batchSize` allow.
+ * Must be used with a LlamaContextInstance that has been created with the `embedding` option set to `false`.
+ * @param {LlamaContextInstance} context - The context instance to use for scoring
+ * @param {string} prompt - Text the candidates continue
+ * @param {string[]} candidates - Candidate continuations to score
+ * @param {Object} [options={}] - Scoring options
+ * @param {number} [options.topK=0] - Also return the K most likely tokens at each candidate position
+ * @param {boolean} [options.addSpecial=false] - Add special tokens to the prompt
+ * @param {boolean} [options.parseSpecial=false] - Parse special tokens in text
+ * @returns {Promise<LlamaCandidateScore[]>} One score per candidate, in input order
+ */
+async function score(context, prompt, candidates, options = {}) {
+  return binding.score(context, prompt, candidates, options)
+}
+
+/**
+ * @typedef {Object} LlamaRerankResult
+ * @property {number} index - Index of the document in the input array
+ * @property {number} score - Relevance score from the model's rank pooling head
+ */
+
+/**
+ * Score documents for relevance to a query with a cross-encoder reranker.
+ * Query/document pairs are packed as separate sequences into shared batches, up to the context's `maxSequences` and `ubatchSize`. `maxSequences` defaults to 8 for rank pooling contexts.
+ * Must be used with a LlamaContextInstance that has been created with `embedding: true` for a model with rank pooling.
+ * @param {LlamaContextInstance} context - The context instance to use for reranking
+ * @param {string} query - Query to rank documents against
+ * @param {string[]} documents - Documents to rank
+ * @param {Object} [options={}] - Reranking options
+ * @param {number} [options.topK=0] - Only return the K most relevant documents, 0 returns all
+ * @param {boolean} [options.parseSpecial=false] - Parse special tokens in text
+ * @returns {Promise<LlamaRerankResult[]>} Documents sorted by descending score
+ */
+async function rerank(context, query, documents, options = {}) {
+  return binding.rerank(context, query, documents, options)
+}
+
+/**
+ * Create a chat session that owns one sequence of a generation context.
+ * The session keeps its KV cache between turns so each turn only decodes the newly appended messages and the reply.
+ * @param {LlamaContextInstance} context - The generation context to hold the session
+ * @param {Object} [options={}] - Session options
+ * @param {number} [options.sequence] - Sequence id to own, defaults to the highest free one or to none until the first reply when all are taken
+ * @param {string} [options.template] - Chat template name or string, defaults to the model's own
+ * @returns {Promise<LlamaSessionInstance>} The created session instance
+ */
+async function createSession(context, options = {}) {
+  const session = {}
+  await binding.createSession(session, context, options)
+  return session
+}
+
+/**
+ * Destroy a session instance and free its sequence
+ * @param {LlamaSessionInstance} session
+ * @returns {Promise<void>}
+ */
+async function destroySession(session) {
+  await binding.destroySession(session)
+  releaseMemory()
+}
+
+/**
+ * Append a message to the session history. It is decoded with the next reply.
+ * @param {LlamaSessionInstance} session
+ * @param {string} role - Message role, such as `system`, `user` or `assistant`
+ * @param {string} content - Message content
+ * @returns {Promise<void>}
+ */
+async function addSessionMessage(session, role, content) {
+  return binding.addSessionMessage(session, role, content)
+}
+
+/**
+ * Generate the assistant reply to the session history and append it
+ * @param {LlamaSessionInstance} session
+ * @param {Object} [options={}] - Generation options
+ * @param {number} [options.maxTokens=20] - Maximum tokens to generate, every sampled token counts even when it produces no text
+ * @param {number} [options.temperature=0.8] - Sampling temperature
+ * @param {number} [options.topK=40] - Sample only from the K most likely tokens
+ * @param {number} [options.seed=0] - Sampler seed
+ * @param {string} [options.grammar] - GBNF grammar the output must match
+ * @param {string} [options.grammarRoot='root'] - Start rule of `grammar`
+ * @param {Object|string} [options.jsonSchema] - JSON schema the output must match, converted to a grammar natively
+ * @returns {Promise<string>} The assistant reply
+ */
+async function generateSessionReply(session, options = {}) {
+  return binding.generateSessionReply(session, grammarOptions(options))
+}
+
+/**
+ * Clear the session history and its KV cache
+ * @param {LlamaSessionInstance} session
+ * @returns {Promise<void>}
+ */
+async function resetSession(session) {
+  return binding.resetSession(session)
+}
+
+/**
+ * Snapshot the session's KV cache and free its sequence for other work.
+ * The next reply restores the snapshot instead of decoding the history again.
+ * @param {LlamaSessionInstance} session
+ * @returns {Promise<void>}
+ */
+async function evictSession(session) {
+  return binding.evictSession(session)
+}
+
+/**
+ * Evict every session of a context that has been idle for longer than its `sessionIdleTimeout`
+ * @param {LlamaContextInstance} context
+ * @returns {Promise<void>}
+ */
+async function evictIdleSessions(context) {
+  return binding.evictIdleSessions(context)
+}
+
+/**
+ * @typedef {Object} LlamaSessionInstanceMetadata
+ * @property {number} sequence - Sequence id owned by the session, -1 while evicted
+ * @property {number} position - Number of tokens the session holds in the KV cache or its snapshot
+ * @property {number} messages - Number of messages in the history
+ * @property {boolean} evicted - Whether the session's KV cache is held in a snapshot
+ * @property {boolean} spilled - Whether the snapshot was spilled to disk
+ * @property {number} stateSize - Bytes of the in-memory snapshot
+ */
+
+/**
+ * Get metadata from a session
+ * @param {LlamaSessionInstance} session
+ * @returns {Promise<LlamaSessionInstanceMetadata>}
+ */
+async function getSessionMetadata(session) {
+  return binding.getSessionMetadata(session)
 }
 
 class LlamaModel {
@@ -142,6 +520,17 @@ class LlamaModel {
   /** @type {LlamaModelContext} */
   #context
 
+  /**
+   * Read a GGUF file's metadata and tensor sizes without loading the weights
+   * @param {string} modelFilepath - Path to the model GGUF file
+   * @param {Object} [options={}] - Inspection options
+   * @param {number} [options.maxArrayLength=1024] - Report longer metadata arrays by their length only
+   * @returns {Promise<LlamaModelFileInfo>}
+   */
+  static async inspect(modelFilepath, options = {}) {
+    return inspectModel(modelFilepath, options)
+  }
+
   static async create(options = {}) {
     const model = new LlamaModel(options.modelFilepath, options)
     await model.init()
@@ -159,6 +548,12 @@ class LlamaModel {
    * @param {boolean} [options.parseSpecial=false] - Whether to parse special tokens in text
    * @param {boolean} [options.removeSpecial=false] - Whether to remove special tokens from output
    * @param {boolean} [options.unparseSpecial=false] - Whether to unparse special tokens in text
+   * @param {boolean} [options.prefetch=false] - Read the whole file into the page cache before mapping it
+   * @param {boolean} [options.mlock=false] - Lock the weights in memory so they are never paged out
+   * @param {boolean} [options.mmap=true] - Map the file instead of reading it into allocated buffers
+   * @param {boolean} [options.warmup=false] - Warm up the initial context with a dummy decode
+   * @param {boolean} [options.queue=false] - Wait for memory to be released instead of failing with `ERR_MEMORY_LIMIT`
+   * @param {number} [options.queueTimeout=0] - Milliseconds to wait for memory before failing, 0 waits forever
    * @param {Object} [options.context] - Customize the initial context created for this model
    */
   constructor(modelFilepath, options = {}) {
@@ -189,16 +584,25 @@ class LlamaModel {
    * @private
    */
   async load() {
-    await loadModel(this.#model, this.modelFilepath)
+    await loadModel(this.#model, this.modelFilepath, {
+      prefetch: this.options.prefetch,
+      mlock: this.options.mlock,
+      mmap: this.options.mmap,
+      queue: this.options.queue,
+      queueTimeout: this.options.queueTimeout
+    })
   }
 
   /**
    * @typedef {Object} LlamaModelMetadata
    * @property {number} parameters - The number of parameters in the model
    * @property {number} contextWindow - The context window size of the model
+   * @property {number} prefetchTime - Milliseconds spent prefetching the file, 0 when not prefetched
+   * @property {boolean} mlock - Whether the weights are locked in memory
+   * @property {number} memorySize - Bytes of weights accounted against the memory limit
    * @property {string} filepath - File path to the model
    * @property {boolean} embedding - Additional model metadata
-   * @property {LlamaModelContextOptions} [context] - Metadata about the model context
+   * @property {LlamaContextInstanceMetadata} [context] - Metadata about the model context
    */
 
   /**
@@ -216,17 +620,18 @@ class LlamaModel {
     }
 
     if (this.#context) {
-      metadata.context = this.#context.options
+      metadata.context = await this.#context.getMetadata()
     }
 
     return metadata
   }
 
   /**
-   * Destroy both the model and context instances associated with this LlamaModel
+   * Destroy both the model and context instances associated with this LlamaModel, open chat sessions keep the weights loaded until they are destroyed
    * @returns {Promise<void>}
    */
   async destroy() {
+    if (this.#context) await this.#context.destroy()
     await destroyModel(this.#model)
   }
 
@@ -271,8 +676,8 @@ class LlamaModel {
    * @param {Object} [options={}] - Options for context creation
    * @param {boolean} [options.embedding=false] - Whether to create an embedding context (true) or generation context (false)
    * @param {boolean} [options.existing=true] - Return existing context if one exists rather than creating new
-   * @param {number} [options.n_ctx=512] - Maximum tokens in context
-   * @param {number} [options.n_batch=512] - Maximum tokens to process in parallel
+   * @param {number} [options.contextSize=2048] - Maximum tokens in context
+   * @param {number} [options.batchSize=512] - Maximum tokens to process in parallel
    * @returns {Promise<LlamaModelContext>} The context instance
    */
   async context(options = {}) {
@@ -280,7 +685,14 @@ class LlamaModel {
       return this.#context
     }
 
+    const previous = this.#context
+
     this.#context = await LlamaModelContext.create(this.#model, options)
+
+    // Release the replaced context now rather than when it is collected, it
+    // still counts against the memory limit until then
+    if (previous) await previous.destroy()
+
     return this.#context
   }
 
@@ -291,6 +703,7 @@ class LlamaModel {
    * @param {Object} [options={}] - Encoding options
    * @param {boolean} [options.addSpecial=false] - Add special tokens to output
    * @param {boolean} [options.parseSpecial=false] - Parse special tokens in text
+   * @param {boolean} [options.normalize=false] - L2-normalize the embedding
    * @returns {Promise<ArrayBuffer>} Array of token embeddings
    */
   async encode(text, options = {}) {
@@ -302,13 +715,60 @@ class LlamaModel {
    * Must be used with a model created with the `embedding` option set to `false`.
    * @param {string} prompt - Text prompt to generate from
    * @param {Object} [options={}] - Generation options
+   * @param {number} [options.maxTokens=20] - Maximum tokens to generate per completion, every sampled token counts even when it produces no text
+   * @param {number} [options.temperature=0.8] - Sampling temperature
+   * @param {number} [options.topK=40] - Sample only from the K most likely tokens
+   * @param {number} [options.seed=0] - Sampler seed, completion `i` uses `seed + i`
+   * @param {string} [options.grammar] - GBNF grammar the output must match
+   * @param {string} [options.grammarRoot='root'] - Start rule of `grammar`
+   * @param {Object|string} [options.jsonSchema] - JSON schema the output must match, converted to a grammar natively
+   * @param {number} [options.n=1] - Number of completions decoded in parallel from one prompt prefill
    * @param {boolean} [options.addSpecial=false] - Add special tokens to output
    * @param {boolean} [options.parseSpecial=false] - Parse special tokens in text
-   * @returns {Promise<string>} Generated text
+   * @returns {Promise<string|string[]>} Generated text, or an array of `n` completions when `n > 1`
    */
   async generate(prompt, options = {}) {
     return this.#context.generate(prompt, options)
   }
+
+  /**
+   * Score how likely each candidate continuation of a prompt is.
+   * Must be used with a model created with the `embedding` option set to `false`.
+   * @param {string} prompt - Text the candidates continue
+   * @param {string[]} candidates - Candidate continuations to score
+   * @param {Object} [options={}] - Scoring options
+   * @param {number} [options.topK=0] - Also return the K most likely tokens at each candidate position
+   * @returns {Promise<LlamaCandidateScore[]>} One score per candidate, in input order
+   */
+  async score(prompt, candidates, options = {}) {
+    return this.#context.score(prompt, candidates, options)
+  }
+
+  /**
+   * Score documents for relevance to a query with a cross-encoder reranker.
+   * Must be used with a reranker model created with the `embedding` option set to `true`.
+   * @param {string} query - Query to rank documents against
+   * @param {string[]} documents - Documents to rank
+   * @param {Object} [options={}] - Reranking options
+   * @param {number} [options.topK=0] - Only return the K most relevant documents, 0 returns all
+   * @returns {Promise<LlamaRerankResult[]>} Documents sorted by descending score
+   */
+  async rerank(query, documents, options = {}) {
+    return this.#context.rerank(query, documents, options)
+  }
+
+  /**
+   * Start a chat session on this model's context.
+   * Must be used with a model created with the `embedding` option set to `false`.
+   * @param {Object} [options={}] - Session options
+   * @param {number} [options.sequence] - Sequence id to own, defaults to the highest free one
+   * @param {string} [options.template] - Chat template name or string, defaults to the model's own
+   * @param {string} [options.system] - System prompt to start the conversation with
+   * @returns {Promise<ChatSession>} The chat session
+   */
+  async chat(options = {}) {
+    return this.#context.chat(options)
+  }
 }
 
 /**
@@ -337,6 +797,19 @@ class LlamaModelContext {
    * @typedef {Object} LlamaModelContextOptions
    * @property {number} [contextSize=2048] - Maximum number of tokens that can be processed at once
    * @property {number} [batchSize=512] - Maximum number of tokens to process in parallel
+   * @property {number} [ubatchSize=512] - Maximum tokens per physical compute step, capped at `batchSize`
+   * @property {number} [maxSequences=1] - Maximum number of sequences sharing the KV cache, 8 by default for rank pooling contexts
+   * @property {boolean} [flashAttention=false] - Use flash attention, required for a quantized V cache
+   * @property {boolean} [warmup=false] - Run a dummy decode of `batchSize` tokens before returning, so the first request runs at full speed
+   * @property {string} [cacheTypeK='f16'] - KV cache type for keys: `f32`, `f16`, `bf16`, `q8_0`, `q5_1`, `q5_0`, `q4_1` or `q4_0`
+   * @property {string} [cacheTypeV='f16'] - KV cache type for values, same choices as `cacheTypeK`, quantized types require `flashAttention`
+   * @property {string} [pooling] - Embedding pooling: `none`, `mean`, `cls`, `last` or `rank`, defaults to the model's own
+   * @property {number} [embeddingCacheSize=0] - Bytes for an LRU cache of embeddings keyed by tokens, pooling and normalization, 0 disables it
+   * @property {number} [sessionIdleTimeout=0] - Milliseconds after which an idle session's KV cache is evicted to a snapshot, 0 disables it
+   * @property {number} [sessionMemoryLimit] - Bytes of evicted session snapshots to keep in memory before spilling the oldest to disk
+   * @property {string} [sessionSpillDirectory] - Directory for snapshots spilled past `sessionMemoryLimit`, snapshots stay in memory without it
+   * @property {boolean} [queue=false] - Wait for memory to be released instead of failing with `ERR_MEMORY_LIMIT`
+   * @property {number} [queueTimeout=0] - Milliseconds to wait for memory before failing, 0 waits forever
    * @property {boolean} [embedding=false] - Whether to create an embedding context (true) or generation context (false)
    * @property {boolean} [options.addSpecial=false] - Add special tokens to output
    * @property {boolean} [options.parseSpecial=false] - Parse special tokens in text
@@ -373,6 +846,32 @@ class LlamaModelContext {
     this.#context = await createContext(this.#model, overridenOptions)
   }
 
+  /**
+   * Write the embedding cache to disk so it survives restarts
+   * @param {string} filepath - File to write
+   * @returns {Promise<void>}
+   */
+  async saveEmbeddingCache(filepath) {
+    await saveEmbeddingCache(this.#context, filepath)
+  }
+
+  /**
+   * Load embeddings saved by `saveEmbeddingCache` into the embedding cache
+   * @param {string} filepath - File to read
+   * @returns {Promise<void>}
+   */
+  async loadEmbeddingCache(filepath) {
+    await loadEmbeddingCache(this.#context, filepath)
+  }
+
+  /**
+   * Get metadata about the native context, including the memory its KV cache allocated
+   * @returns {Promise<LlamaContextInstanceMetadata>}
+   */
+  async getMetadata() {
+    return getContextMetadata(this.#context)
+  }
+
   /**
    * Destroy the context associated with this LlamaModelContext
    * @returns {Promise<void>}
@@ -388,6 +887,7 @@ class LlamaModelContext {
    * @param {Object} [options={}] - Encoding options
    * @param {boolean} [options.addSpecial=false] - Add special tokens to output
    * @param {boolean} [options.parseSpecial=false] - Parse special tokens in text
+   * @param {boolean} [options.normalize=false] - L2-normalize the embedding
    * @returns {Promise<ArrayBuffer>} Array of token embeddings
    */
   async encode(text, options = {}) {
@@ -411,9 +911,17 @@ class LlamaModelContext {
    * Must be used with a LlamaContextInstance created with the `embedding` option set to `false`.
    * @param {string} prompt - Text prompt to generate from
    * @param {Object} [options={}] - Generation options
+   * @param {number} [options.maxTokens=20] - Maximum tokens to generate per completion, every sampled token counts even when it produces no text
+   * @param {number} [options.temperature=0.8] - Sampling temperature
+   * @param {number} [options.topK=40] - Sample only from the K most likely tokens
+   * @param {number} [options.seed=0] - Sampler seed, completion `i` uses `seed + i`
+   * @param {string} [options.grammar] - GBNF grammar the output must match
+   * @param {string} [options.grammarRoot='root'] - Start rule of `grammar`
+   * @param {Object|string} [options.jsonSchema] - JSON schema the output must match, converted to a grammar natively
+   * @param {number} [options.n=1] - Number of completions decoded in parallel from one prompt prefill
    * @param {boolean} [options.addSpecial=false] - Add special tokens to output
    * @param {boolean} [options.parseSpecial=false] - Parse special tokens in text
-   * @returns {Promise<string>} Generated text
+   * @returns {Promise<string|string[]>} Generated text, or an array of `n` completions when `n > 1`
    */
   async generate(prompt, options = {}) {
     if (this.options.embedding) {
@@ -428,21 +936,517 @@ class LlamaModelContext {
       ...options
     }
 
-    return binding.generate(this.#context, prompt, overridenOptions)
+    return generate(this.#context, prompt, overridenOptions)
+  }
+
+  /**
+   * Score how likely each candidate continuation of a prompt is.
+   * Must be used with a LlamaContextInstance created with the `embedding` option set to `false`.
+   * @param {string} prompt - Text the candidates continue
+   * @param {string[]} candidates - Candidate continuations to score
+   * @param {Object} [options={}] - Scoring options
+   * @param {number} [options.topK=0] - Also return the K most likely tokens at each candidate position
+   * @param {boolean} [options.addSpecial=false] - Add special tokens to the prompt
+   * @param {boolean} [options.parseSpecial=false] - Parse special tokens in text
+   * @returns {Promise<LlamaCandidateScore[]>} One score per candidate, in input order
+   */
+  async score(prompt, candidates, options = {}) {
+    if (this.options.embedding) {
+      throw new Error(
+        'Cannot score text without a generation context. Use `embedding: false` when creating the context'
+      )
+    }
+
+    const overridenOptions = {
+      addSpecial: this.options.addSpecial,
+      parseSpecial: this.options.parseSpecial,
+      ...options
+    }
+
+    return score(this.#context, prompt, candidates, overridenOptions)
+  }
+
+  /**
+   * Score documents for relevance to a query with a cross-encoder reranker.
+   * Must be used with a LlamaContextInstance created with the `embedding` option set to `true` and rank pooling.
+   * @param {string} query - Query to rank documents against
+   * @param {string[]} documents - Documents to rank
+   * @param {Object} [options={}] - Reranking options
+   * @param {number} [options.topK=0] - Only return the K most relevant documents, 0 returns all
+   * @param {boolean} [options.parseSpecial=false] - Parse special tokens in text
+   * @returns {Promise<LlamaRerankResult[]>} Documents sorted by descending score
+   */
+  async rerank(query, documents, options = {}) {
+    if (!this.options.embedding) {
+      throw new Error(
+        'Cannot rerank documents without an embedding context. Use `embedding: true` when creating the context.'
+      )
+    }
+
+    const overridenOptions = {
+      parseSpecial: this.options.parseSpecial,
+      ...options
+    }
+
+    return rerank(this.#context, query, documents, overridenOptions)
+  }
+
+  /**
+   * Evict sessions that have been idle for longer than `sessionIdleTimeout`.
+   * Idle sessions are also swept before every reply, this only frees their memory sooner.
+   * @returns {Promise<void>}
+   */
+  async evictIdleSessions() {
+    await evictIdleSessions(this.#context)
+  }
+
+  /**
+   * Start a chat session that owns one sequence of this context.
+   * Must be used with a LlamaContextInstance created with the `embedding` option set to `false`.
+   * @param {Object} [options={}] - Session options
+   * @param {number} [options.sequence] - Sequence id to own, defaults to the highest free one
+   * @param {string} [options.template] - Chat template name or string, defaults to the model's own
+   * @param {string} [options.system] - System prompt to start the conversation with
+   * @returns {Promise<ChatSession>} The chat session
+   */
+  async chat(options = {}) {
+    if (this.options.embedding) {
+      throw new Error(
+        'Cannot chat without a generation context. Use `embedding: false` when creating the context'
+      )
+    }
+
+    return ChatSession.create(this.#context, options)
+  }
+}
+
+/**
+ * A conversation bound to one sequence of a context.
+ * Each turn applies the chat template natively and only decodes the newly appended messages and the generated reply, so prefill cost does not grow with the conversation.
+ * @class
+ */
+class ChatSession {
+  /** @type {LlamaSessionInstance} */
+  #session
+
+  /**
+   * Creates a new ChatSession that is fully initialized and ready to use
+   * @param {LlamaContextInstance} context - The generation context to hold the session
+   * @param {Object} [options={}] - Session options
+   * @param {number} [options.sequence] - Sequence id to own, defaults to the highest free one
+   * @param {string} [options.template] - Chat template name or string, defaults to the model's own
+   * @param {string} [options.system] - System prompt to start the conversation with
+   * @returns {Promise<ChatSession>}
+   */
+  static async create(context, options = {}) {
+    const session = new ChatSession(context, options)
+    await session.init()
+    return session
+  }
+
+  /**
+   * Creates a new ChatSession that can be lazily initialized using the `init` method
+   * @param {LlamaContextInstance} context - The generation context to hold the session
+   * @param {Object} [options={}] - Session options
+   */
+  constructor(context, options = {}) {
+    this.context = context
+    this.options = options
+  }
+
+  /**
+   * Initializes the native session and adds the system prompt, if any
+   * @returns {Promise<void>}
+   */
+  async init() {
+    this.#session = await createSession(this.context, this.options)
+
+    if (this.options.system) {
+      await addSessionMessage(this.#session, 'system', this.options.system)
+    }
+  }
+
+  /**
+   * Append a message without generating a reply
+   * @param {string} role - Message role, such as `system`, `user` or `assistant`
+   * @param {string} content - Message content
+   * @returns {Promise<void>}
+   */
+  async add(role, content) {
+    await addSessionMessage(this.#session, role, content)
+  }
+
+  /**
+   * Send a user message and generate the assistant reply
+   * @param {string} content - User message
+   * @param {Object} [options={}] - Generation options
+   * @param {number} [options.maxTokens=20] - Maximum tokens to generate, every sampled token counts even when it produces no text
+   * @param {number} [options.temperature=0.8] - Sampling temperature
+   * @param {number} [options.topK=40] - Sample only from the K most likely tokens
+   * @param {string} [options.grammar] - GBNF grammar the output must match
+   * @param {string} [options.grammarRoot='root'] - Start rule of `grammar`
+   * @param {Object|string} [options.jsonSchema] - JSON schema the output must match, converted to a grammar natively
+   * @returns {Promise<string>} The assistant reply
+   */
+  async send(content, options = {}) {
+    await addSessionMessage(this.#session, 'user', content)
+    return generateSessionReply(this.#session, options)
+  }
+
+  /**
+   * Get the session's sequence id, KV cache position and message count
+   * @returns {Promise<LlamaSessionInstanceMetadata>}
+   */
+  async getMetadata() {
+    return getSessionMetadata(this.#session)
+  }
+
+  /**
+   * Snapshot the session's KV cache and free its sequence. The next `send` restores it.
+   * @returns {Promise<void>}
+   */
+  async evict() {
+    await evictSession(this.#session)
+  }
+
+  /**
+   * Clear the conversation, keeping the system prompt if one was given
+   * @returns {Promise<void>}
+   */
+  async reset() {
+    await resetSession(this.#session)
+
+    if (this.options.system) {
+      await addSessionMessage(this.#session, 'system', this.options.system)
+    }
+  }
+
+  /**
+   * Destroy the session and free its sequence
+   * @returns {Promise<void>}
+   */
+  async destroy() {
+    await destroySession(this.#session)
+  }
+}
+
+/**
+ * Priority classes understood by LlamaScheduler, most urgent first
+ * @type {Object<string, number>}
+ */
+const PRIORITIES = {
+  interactive: 0,
+  normal: 1,
+  background: 2
+}
+
+/**
+ * @typedef {Object} LlamaScheduledResult
+ * @property {*} result - What the scheduled call returned
+ * @property {number} queueTime - Milliseconds the request waited before a context picked it up
+ * @property {number} runTime - Milliseconds the request ran on its context
+ */
+
+/**
+ * @typedef {Object} LlamaSchedulerStats
+ * @property {number} queued - Requests waiting for a context
+ * @property {number} running - Requests running on a context
+ * @property {number} completed - Requests that ran to completion or failed while running
+ * @property {number} shed - Requests rejected or dropped because the queue was full
+ * @property {number} expired - Requests whose deadline passed while queued
+ */
+
+function schedulerError(message, code) {
+  const err = new Error(message)
+  err.code = code
+  return err
+}
+
+/**
+ * Dispatches requests to a pool of contexts by priority class, then by fair
+ * share between tenants, then by earliest deadline.
+ * Inference calls block the thread they run on, so the queue is ordered
+ * between calls: requests arriving while one runs are ranked before the next
+ * is picked, rather than running in arrival order.
+ * @class
+ */
+class LlamaScheduler {
+  /** @type {LlamaModelContext[]} */
+  #contexts
+
+  /** @type {boolean[]} */
+  #busy
+
+  #queue = []
+  #tenants = new Map()
+  #sequence = 0
+  #scheduled = false
+  #stats = { completed: 0, shed: 0, expired: 0 }
+
+  /**
+   * Creates a new scheduler in front of a pool of contexts
+   * @param {LlamaModelContext|LlamaModelContext[]} contexts - Contexts requests are dispatched to, each runs one request at a time
+   * @param {Object} [options={}] - Scheduler options
+   * @param {number} [options.maxQueueDepth=Infinity] - Requests that may wait at once. When full, a request sheds the newest queued request of a lower priority class, or is rejected with `ERR_QUEUE_FULL`.
+   * @param {Object<string, number>} [options.tenantWeights={}] - Relative share of run time per tenant key, tenants default to 1
+   */
+  constructor(contexts, options = {}) {
+    this.#contexts = Array.isArray(contexts) ? contexts : [contexts]
+    this.#busy = this.#contexts.map(() => false)
+    this.options = {
+      maxQueueDepth: Infinity,
+      tenantWeights: {},
+      ...options
+    }
+  }
+
+  /**
+   * Queue a call on the next context the scheduler picks for it
+   * @param {(context: LlamaModelContext) => Promise<*>} task - The call to run
+   * @param {Object} [options={}] - Scheduling options
+   * @param {string|number} [options.priority='normal'] - `interactive`, `normal` or `background`, or a number where lower runs first
+   * @param {number} [options.deadline] - Timestamp in milliseconds after which the request is rejected with `ERR_DEADLINE_EXCEEDED` instead of starting
+   * @param {number} [options.timeout] - Like `deadline`, relative to now
+   * @param {string} [options.tenant='default'] - Key run time is shared fairly between within a priority class
+   * @returns {Promise<LlamaScheduledResult>}
+   */
+  run(task, options = {}) {
+    const priority = typeof options.priority === 'number'
+      ? options.priority
+      : PRIORITIES[options.priority || 'normal']
+
+    if (priority === undefined) {
+      return Promise.reject(new Error(`Unknown priority '${options.priority}'`))
+    }
+
+    const now = Date.now()
+    const deadline = options.deadline !== undefined
+      ? options.deadline
+      : options.timeout !== undefined ? now + options.timeout : Infinity
+
+    return new Promise((resolve, reject) => {
+      const request = {
+        task,
+        priority,
+        deadline,
+        tenant: this.#getTenant(options.tenant || 'default'),
+        sequence: this.#sequence++,
+        queuedAt: now,
+        resolve,
+        reject
+      }
+
+      if (this.#queue.length >= this.options.maxQueueDepth && !this.#shed(request)) {
+        this.#stats.shed++
+        reject(schedulerError('Request queue is full', 'ERR_QUEUE_FULL'))
+        return
+      }
+
+      this.#queue.push(request)
+      this.#schedule()
+    })
+  }
+
+  /**
+   * Generate text on a pooled generation context
+   * @param {string} prompt - Text to continue
+   * @param {Object} [options={}] - Generation options for `LlamaModelContext.generate`, plus the scheduling options of `run`
+   * @returns {Promise<LlamaScheduledResult>}
+   */
+  async generate(prompt, options = {}) {
+    return this.run((context) => context.generate(prompt, options), options)
+  }
+
+  /**
+   * Encode text on a pooled embedding context
+   * @param {string} text - Text to encode
+   * @param {Object} [options={}] - Encoding options for `LlamaModelContext.encode`, plus the scheduling options of `run`
+   * @returns {Promise<LlamaScheduledResult>}
+   */
+  async encode(text, options = {}) {
+    return this.run((context) => context.encode(text, options), options)
+  }
+
+  /**
+   * Score candidate continuations on a pooled generation context
+   * @param {string} prompt - Text the candidates continue
+   * @param {string[]} candidates - Candidate continuations to score
+   * @param {Object} [options={}] - Scoring options for `LlamaModelContext.score`, plus the scheduling options of `run`
+   * @returns {Promise<LlamaScheduledResult>}
+   */
+  async score(prompt, candidates, options = {}) {
+    return this.run((context) => context.score(prompt, candidates, options), options)
+  }
+
+  /**
+   * Rerank documents on a pooled rank pooling context
+   * @param {string} query - Query to rank the documents against
+   * @param {string[]} documents - Documents to rank
+   * @param {Object} [options={}] - Reranking options for `LlamaModelContext.rerank`, plus the scheduling options of `run`
+   * @returns {Promise<LlamaScheduledResult>}
+   */
+  async rerank(query, documents, options = {}) {
+    return this.run((context) => context.rerank(query, documents, options), options)
+  }
+
+  /**
+   * Get queue depth and request counters
+   * @returns {LlamaSchedulerStats}
+   */
+  getStats() {
+    return {
+      queued: this.#queue.length,
+      running: this.#busy.filter(Boolean).length,
+      ...this.#stats
+    }
+  }
+
+  #getTenant(key) {
+    let tenant = this.#tenants.get(key)
+
+    if (tenant === undefined) {
+      // Start new tenants level with the least served one so they neither
+      // starve others nor get starved by accumulated history
+      let usage = Infinity
+      for (const other of this.#tenants.values()) usage = Math.min(usage, other.usage)
+
+      tenant = {
+        weight: this.options.tenantWeights[key] || 1,
+        usage: usage === Infinity ? 0 : usage
+      }
+
+      this.#tenants.set(key, tenant)
+    }
+
+    return tenant
+  }
+
+  // Make room for a request by dropping the newest queued request of a
+  // strictly lower priority class
+  #shed(request) {
+    let victim = -1
+
+    for (let i = 0; i < this.#queue.length; i++) {
+      const queued = this.#queue[i]
+      if (queued.priority <= request.priority) continue
+
+      const current = this.#queue[victim]
+      if (victim === -1 || queued.priority > current.priority || (queued.priority === current.priority && queued.sequence > current.sequence)) {
+        victim = i
+      }
+    }
+
+    if (victim === -1) return false
+
+    const [dropped] = this.#queue.splice(victim, 1)
+
+    this.#stats.shed++
+    dropped.reject(schedulerError('Request shed for a higher priority request', 'ERR_QUEUE_FULL'))
+
+    return true
+  }
+
+  // Most urgent class first, then the tenant with the least weighted run
+  // time, then the earliest deadline, then arrival order
+  #next() {
+    let best = -1
+
+    for (let i = 0; i < this.#queue.length; i++) {
+      if (best === -1 || this.#compare(this.#queue[i], this.#queue[best]) < 0) best = i
+    }
+
+    return this.#queue.splice(best, 1)[0]
+  }
+
+  #compare(a, b) {
+    if (a.priority !== b.priority) return a.priority - b.priority
+    if (a.tenant !== b.tenant && a.tenant.usage !== b.tenant.usage) return a.tenant.usage - b.tenant.usage
+    if (a.deadline !== b.deadline) return a.deadline < b.deadline ? -1 : 1
+    return a.sequence - b.sequence
+  }
+
+  // Dispatch on a later turn of the event loop, so requests made in the same
+  // turn are ranked together instead of the first one winning
+  #schedule() {
+    if (this.#scheduled) return
+    this.#scheduled = true
+
+    setTimeout(() => {
+      this.#scheduled = false
+      this.#dispatch()
+    }, 0)
+  }
+
+  #dispatch() {
+    const now = Date.now()
+
+    for (let i = this.#queue.length - 1; i >= 0; i--) {
+      const request = this.#queue[i]
+
+      if (request.deadline <= now) {
+        this.#queue.splice(i, 1)
+        this.#stats.expired++
+        request.reject(schedulerError('Request deadline exceeded while queued', 'ERR_DEADLINE_EXCEEDED'))
+      }
+    }
+
+    for (let i = 0; i < this.#contexts.length && this.#queue.length > 0; i++) {
+      if (!this.#busy[i]) this.#start(i, this.#next())
+    }
+  }
+
+  async #start(i, request) {
+    this.#busy[i] = true
+
+    const startedAt = Date.now()
+
+    try {
+      const result = await request.task(this.#contexts[i])
+      const runTime = Date.now() - startedAt
+
+      request.resolve({ result, queueTime: startedAt - request.queuedAt, runTime })
+    } catch (err) {
+      request.reject(err)
+    } finally {
+      request.tenant.usage += (Date.now() - startedAt) / request.tenant.weight
+
+      this.#busy[i] = false
+      this.#stats.completed++
+
+      if (this.#queue.length > 0) this.#schedule()
+    }
   }
 }
 
 module.exports = {
+  setMemoryLimit,
+  getMemoryUsage,
   createModel,
   loadModel,
   destroyModel,
   tokenize,
   detokenize,
   getModelMetadata,
+  inspectModel,
   createContext,
+  getContextMetadata,
   destroyContext,
   encode,
+  saveEmbeddingCache,
+  loadEmbeddingCache,
   generate,
+  score,
+  rerank,
+  createSession,
+  destroySession,
+  addSessionMessage,
+  generateSessionReply,
+  resetSession,
+  getSessionMetadata,
+  evictSession,
+  evictIdleSessions,
   LlamaModel,
-  LlamaModelContext
+  LlamaModelContext,
+  ChatSession,
+  LlamaScheduler
 }
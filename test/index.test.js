@@ -1,7 +1,9 @@
 const test = require('brittle')
-const { LlamaModel } = require('../index.js')
+const fs = require('fs')
+const { LlamaModel, LlamaScheduler, setMemoryLimit, getMemoryUsage } = require('../index.js')
 
 const modelFilepath = './models/smollm/SmolLM-135M-Instruct.Q8_0.gguf'
+const rerankerFilepath = './models/bge-reranker/bge-reranker-v2-m3-Q8_0.gguf'
 
 test('LlamaModel loads and initializes correctly', async function (t) {
   t.plan(4)
@@ -91,3 +93,322 @@ test('LlamaModel handles text generation', async function (t) {
     'Should generate coherent text'
   )
 })
+
+test('LlamaModel prefetches weights and warms up its context', async function (t) {
+  const model = await LlamaModel.create({ modelFilepath, prefetch: true, warmup: true })
+
+  t.teardown(async () => await model.destroy())
+
+  const metadata = await model.getMetadata()
+  t.ok(metadata.prefetchTime > 0, 'Should report the prefetch time')
+  t.ok(metadata.context.warmupTime > 0, 'Should report the warmup time')
+
+  const generated = await model.generate('The quick brown fox', { maxTokens: 4 })
+  t.ok(generated.length > 0, 'Should generate after warmup')
+})
+
+test('LlamaModel admits models and contexts against the memory limit', async function (t) {
+  const before = getMemoryUsage()
+
+  const model = await LlamaModel.create({ modelFilepath })
+
+  const usage = getMemoryUsage()
+  t.ok(usage.models > before.models, 'Should account the model weights')
+  t.ok(usage.contexts > before.contexts, 'Should account the context')
+
+  setMemoryLimit(usage.used + 1)
+
+  try {
+    await model.context()
+    t.fail('Should refuse a context over the limit')
+  } catch (err) {
+    t.is(err.code, 'ERR_MEMORY_LIMIT', 'Should fail fast with ERR_MEMORY_LIMIT')
+  } finally {
+    setMemoryLimit(0)
+  }
+
+  await model.destroy()
+
+  t.ok(getMemoryUsage().used <= before.used, 'Should release everything on destroy')
+})
+
+test('ChatSession keeps the model loaded after LlamaModel.destroy', async function (t) {
+  const before = getMemoryUsage()
+
+  const model = await LlamaModel.create({ modelFilepath })
+  const session = await model.chat({ system: 'You are a helpful assistant.' })
+
+  await model.destroy()
+
+  const reply = await session.send('Hi there!', { maxTokens: 8 })
+  t.ok(typeof reply === 'string', 'Should generate with the destroyed model')
+
+  await session.destroy()
+
+  t.ok(getMemoryUsage().used <= before.used, 'Should release the model with the last session')
+})
+
+test('LlamaModel reports smaller KV cache for quantized cache types', async function (t) {
+  const model = await LlamaModel.create({ modelFilepath, contextSize: 1024 })
+
+  t.teardown(async () => await model.destroy())
+
+  const { context: f16 } = await model.getMetadata()
+  t.is(f16.cacheTypeK, 'f16', 'Should default to f16 keys')
+  t.ok(f16.kvCacheSize > 0, 'Should report KV cache size')
+
+  await model.context({
+    contextSize: 1024,
+    flashAttention: true,
+    cacheTypeK: 'q8_0',
+    cacheTypeV: 'q8_0'
+  })
+
+  const { context: q8 } = await model.getMetadata()
+  t.is(q8.cacheTypeV, 'q8_0', 'Should use q8_0 values')
+  t.ok(q8.kvCacheSize < f16.kvCacheSize, 'Should allocate less KV memory')
+})
+
+test('LlamaModel generates n completions from one prompt', async function (t) {
+  const model = await LlamaModel.create({ modelFilepath, maxSequences: 4 })
+
+  t.teardown(async () => await model.destroy())
+
+  const completions = await model.generate('Once upon a time', {
+    maxTokens: 8,
+    n: 4
+  })
+
+  t.is(completions.length, 4, 'Should return one completion per branch')
+  t.ok(
+    completions.every((text) => typeof text === 'string' && text.length > 0),
+    'Should generate text for every branch'
+  )
+
+  await t.exception(
+    () => model.generate('Once upon a time', { n: 5 }),
+    /maxSequences/,
+    'Should reject more branches than sequences'
+  )
+})
+
+test('LlamaModel scores candidate continuations', async function (t) {
+  const model = await LlamaModel.create({ modelFilepath, maxSequences: 2 })
+
+  t.teardown(async () => await model.destroy())
+
+  const [likely, unlikely, other] = await model.score(
+    'The quick brown fox jumps over the lazy',
+    [' dog', ' refrigerator', ' cat'],
+    { topK: 3 }
+  )
+
+  t.ok(likely.logprob < 0, 'Should return a log-probability')
+  t.ok(likely.logprob > unlikely.logprob, 'Should prefer the likely ending')
+  t.is(likely.logprobs.length, likely.tokens.length, 'Should score every token')
+  t.is(other.alternatives[0].length, 3, 'Should return top-k alternatives')
+})
+
+test('LlamaModel rejects reranking without rank pooling', async function (t) {
+  const model = await LlamaModel.create({
+    modelFilepath,
+    embedding: true,
+    pooling: 'mean'
+  })
+
+  t.teardown(async () => await model.destroy())
+
+  await t.exception(
+    () => model.rerank('query', ['document']),
+    /not configured for reranking/,
+    'Should require a rank pooling context'
+  )
+})
+
+test('LlamaModel ranks the relevant document first', { skip: !fs.existsSync(rerankerFilepath) }, async function (t) {
+  const model = await LlamaModel.create({
+    modelFilepath: rerankerFilepath,
+    embedding: true,
+    pooling: 'rank'
+  })
+
+  t.teardown(async () => await model.destroy())
+
+  const metadata = await model.getMetadata()
+  t.ok(metadata.context.maxSequences > 1, 'Should pack pairs into shared batches by default')
+
+  const ranked = await model.rerank('What is the capital of France?', [
+    'Bananas are a yellow fruit.',
+    'Paris is the capital of France.',
+    'The Eiffel Tower is in Paris.'
+  ])
+
+  t.is(ranked.length, 3, 'Should rank every document')
+  t.is(ranked[0].index, 1, 'Should rank the relevant document first')
+  t.ok(ranked[0].score >= ranked[1].score && ranked[1].score >= ranked[2].score, 'Should sort by score')
+})
+
+test('ChatSession only decodes new turns', async function (t) {
+  const model = await LlamaModel.create({ modelFilepath, maxSequences: 2 })
+
+  t.teardown(async () => await model.destroy())
+
+  const session = await model.chat({ system: 'You are a helpful assistant.' })
+
+  const first = await session.send('Hi there!', { maxTokens: 8 })
+  t.ok(typeof first === 'string', 'Should reply to the first turn')
+
+  const before = await session.getMetadata()
+
+  await session.send('What is 2 + 2?', { maxTokens: 8 })
+
+  const after = await session.getMetadata()
+  t.is(after.messages, 5, 'Should keep the full history')
+  t.ok(after.position > before.position, 'Should append to the KV cache')
+
+  const generated = await model.generate('The quick brown fox', { maxTokens: 4 })
+  t.ok(generated.length > 0, 'Should still generate on a free sequence')
+
+  await session.destroy()
+})
+
+test('ChatSession restores evicted sessions without losing turns', async function (t) {
+  const model = await LlamaModel.create({ modelFilepath, maxSequences: 1 })
+
+  t.teardown(async () => await model.destroy())
+
+  const first = await model.chat({ system: 'You are a helpful assistant.' })
+  const second = await model.chat({ system: 'You are a helpful assistant.' })
+
+  await first.send('Hi there!', { maxTokens: 8 })
+  await second.send('Hello!', { maxTokens: 8 })
+
+  const evicted = await first.getMetadata()
+  t.ok(evicted.evicted, 'Should evict the least recently used session')
+  t.ok(evicted.stateSize > 0, 'Should keep a snapshot of its KV cache')
+
+  await first.send('What is 2 + 2?', { maxTokens: 8 })
+
+  const restored = await first.getMetadata()
+  t.absent(restored.evicted, 'Should restore the session on its next turn')
+  t.ok(restored.position > evicted.position, 'Should continue from the snapshot')
+  t.ok((await second.getMetadata()).evicted, 'Should evict the other session in turn')
+
+  await first.destroy()
+  await second.destroy()
+})
+
+test('ChatSession has room after parallel completions', async function (t) {
+  const model = await LlamaModel.create({ modelFilepath, contextSize: 256, maxSequences: 5 })
+
+  t.teardown(async () => await model.destroy())
+
+  const completions = await model.generate('The quick brown fox', { maxTokens: 48, n: 4 })
+  t.is(completions.length, 4, 'Should generate every completion')
+
+  const session = await model.chat({ system: 'You are a helpful assistant.' })
+  const reply = await session.send('Hi there!', { maxTokens: 64 })
+  t.ok(typeof reply === 'string', 'Should find free KV cells for the session')
+
+  await session.destroy()
+})
+
+test('LlamaModel inspects a model file without loading it', async function (t) {
+  const info = await LlamaModel.inspect(modelFilepath)
+
+  t.is(info.architecture, 'llama', 'Should read the architecture')
+  t.is(info.quantization, 'Q8_0', 'Should read the quantization')
+  t.ok(info.vocabSize > 0, 'Should read the vocabulary size')
+  t.ok(info.tensors.length > 0, 'Should list tensors')
+  t.ok(info.tensorSize > 0, 'Should sum tensor sizes')
+  t.is(
+    typeof info.metadata['tokenizer.ggml.tokens'],
+    'number',
+    'Should report long arrays by length'
+  )
+
+  await t.exception(
+    () => LlamaModel.inspect('nope'),
+    /Failed to read model/,
+    'Should throw on missing model file'
+  )
+})
+
+test('LlamaModel caches repeated embeddings', async function (t) {
+  const model = await LlamaModel.create({
+    modelFilepath,
+    embedding: true,
+    embeddingCacheSize: 1024 * 1024
+  })
+
+  t.teardown(async () => await model.destroy())
+
+  const first = new Float64Array(await model.encode('Hello world'))
+  const second = new Float64Array(await model.encode('Hello world'))
+  await model.encode('Hello world', { normalize: true })
+
+  t.alike(second, first, 'Should return the cached embedding')
+
+  const { context } = await model.getMetadata()
+  t.is(context.embeddingCache.hits, 1, 'Should count cache hits')
+  t.is(context.embeddingCache.misses, 2, 'Should key on normalization')
+  t.is(context.embeddingCache.entries, 2, 'Should store each variant once')
+})
+
+test('LlamaModel generates output matching a JSON schema', async function (t) {
+  const model = await LlamaModel.create({ modelFilepath })
+
+  t.teardown(async () => await model.destroy())
+
+  const jsonSchema = {
+    type: 'object',
+    properties: { answer: { type: 'boolean' } },
+    required: ['answer']
+  }
+
+  for (let i = 0; i < 2; i++) {
+    const generated = await model.generate('Is the sky blue? Answer in JSON: ', {
+      jsonSchema,
+      maxTokens: 32,
+      seed: i
+    })
+
+    t.is(typeof JSON.parse(generated).answer, 'boolean', 'Should match schema')
+  }
+
+  const digits = await model.generate('Count: ', {
+    grammar: 'root ::= [0-9]+',
+    maxTokens: 4
+  })
+
+  t.ok(/^[0-9]+$/.test(digits), 'Should match GBNF grammar')
+
+  await t.exception(
+    () => model.generate('Count: ', { grammar: 'root ::= (' }),
+    /Failed to parse grammar/,
+    'Should reject invalid grammars'
+  )
+})
+
+test('LlamaScheduler runs interactive requests ahead of background ones', async function (t) {
+  const model = await LlamaModel.create({ modelFilepath })
+
+  t.teardown(async () => await model.destroy())
+
+  const context = await model.context({ existing: true })
+  const scheduler = new LlamaScheduler(context, { maxQueueDepth: 2 })
+
+  const background = scheduler.generate('Summarize the history of Rome.', { maxTokens: 8, priority: 'background' })
+  const interactive = scheduler.generate('Hi!', { maxTokens: 4, priority: 'interactive' })
+  const rejected = t.exception(
+    scheduler.generate('Hello!', { maxTokens: 4, priority: 'background' }),
+    /queue is full/,
+    'Should reject past maxQueueDepth'
+  )
+
+  const [first, second] = await Promise.all([interactive, background])
+  t.ok(first.queueTime <= second.queueTime, 'Should start the interactive request first')
+  t.ok(typeof first.result === 'string', 'Should return the generated text')
+
+  await rejected
+})